@@ -0,0 +1,501 @@
+#!/usr/bin/env perl
+###############################################################################
+## ----------------------------------------------------------------------------
+## Benchmark the bin scripts across ranges, modes, sieve sizes, and workers.
+##
+###############################################################################
+
+use strict;
+use warnings;
+
+use Cwd qw(abs_path);
+
+my ($prog_name, $prog_dir, $base_dir);
+
+BEGIN {
+   $prog_name = $0;             $prog_name =~ s{^.*[\\/]}{}g;
+   $prog_dir  = abs_path($0);   $prog_dir  =~ s{[\\/][^\\/]*$}{};
+   $base_dir  = $prog_dir;      $base_dir  =~ s{[\\/][^\\/]*$}{};
+
+   unshift @INC, "$base_dir/lib";
+}
+
+use Getopt::Long qw(:config bundling no_ignore_case no_auto_abbrev);
+use Scalar::Util qw(looks_like_number);
+use Time::HiRes  qw(time);
+use File::Temp   qw(tempfile);
+use POSIX        ();
+use JSON::PP     ();
+
+use MCE;
+
+###############################################################################
+## ----------------------------------------------------------------------------
+## Display usage and exit.
+##
+###############################################################################
+
+sub usage()
+{
+   print STDERR <<"::_USAGE_BLOCK_END_::";
+
+NAME
+   $prog_name -- benchmark algorithm3, primesieve, and primeutil
+
+SYNOPISIS
+   $prog_name [options]
+
+DESCRIPTION
+   The $prog_name utility runs the bin scripts across a matrix of engines,
+   ranges, modes, sieve sizes, and max workers. Each combination is run a
+   number of times and the results are written as JSON or CSV, including
+   primes per second and the efficiency per worker relative to 1 worker.
+
+   The number of primes per range is counted once by algorithm3.pl and is
+   used for the rates of every mode. Counts from each run are checked with
+   it. Printed primes go to /dev/null.
+
+   Engines:
+   algorithm3   bin/algorithm3.pl, the sieve (--method=sieve if counting)
+   lmo          bin/algorithm3.pl --method=lmo, count mode only
+   wheel30      bin/algorithm3.pl --wheel=30, the mod-30 sieve engine
+   primesieve   bin/primesieve.pl
+   primeutil    bin/primeutil.pl, if Math::Prime::Util is installed
+
+   Ranges:
+   low          1 through 1e8
+   2^32         1 through 4294967296
+   1e12         1e12 through 1e12+1e9
+   2^64         the last 1e9 numbers below 2^64 - 6
+
+   The following options are available:
+
+   --engines=<list>     engines to run (default algorithm3,primesieve,primeutil)
+   --ranges=<list>      range names to run (default low,2^32,1e12,2^64)
+   --range=<from:to>    add a range, may be repeated (e.g. 1e15:1e15+1e9);
+                        the default ranges are not run unless in --ranges
+   --modes=<list>       count, sum, or print (default count,sum,print)
+   --sieve-sizes=<list> sieve sizes for algorithm3 (default auto)
+   --workers=<list>     max workers (default 1,auto)
+   --repeat=<val>       runs per combination (default 3)
+   --format=<val>       output format json or csv (default json)
+   --output=<file>      write results to file (default STDOUT)
+   --help,  -h          display this help and exit
+   --quiet, -q          suppress progress
+
+EXAMPLES
+   $prog_name --ranges=low,2^32 --workers=1,2,4,auto > results.json
+   $prog_name --engines=algorithm3 --modes=count --sieve-sizes=auto,4084080
+   $prog_name --engines=algorithm3,wheel30 --ranges=2^32,1e12
+   $prog_name --range=1e15:1e15+1e10 --repeat=5 --format=csv
+
+::_USAGE_BLOCK_END_::
+
+   exit 1;
+}
+
+###############################################################################
+## ----------------------------------------------------------------------------
+## Engines and ranges.
+##
+###############################################################################
+
+## Script, extra arguments per mode, and whether --sieve-size is accepted.
+
+my %engines = (
+   algorithm3 => {
+      script => 'algorithm3.pl', sieve_size => 1,
+      args => { count => [ '--method=sieve' ], sum => [], print => [] },
+   },
+   lmo => {
+      script => 'algorithm3.pl', sieve_size => 0,
+      args => { count => [ '--method=lmo' ] },
+   },
+   wheel30 => {
+      script => 'algorithm3.pl', sieve_size => 1,
+      args => {
+         count => [ '--method=sieve', '--wheel=30' ],
+         sum => [ '--wheel=30' ], print => [ '--wheel=30' ],
+      },
+   },
+   primesieve => {
+      script => 'primesieve.pl', sieve_size => 0,
+      args => { count => [], sum => [], print => [] },
+   },
+   primeutil => {
+      script => 'primeutil.pl', sieve_size => 0, module => 'Math::Prime::Util',
+      args => { count => [], sum => [], print => [] },
+   },
+);
+
+my %ranges = (
+   'low'  => [ '1', '1e8' ],
+   '2^32' => [ '1', '4294967296' ],
+   '1e12' => [ '1e12', '1e12+1e9' ],
+   '2^64' => [ '18446744072709551609', '18446744073709551609' ],
+);
+
+my @mode_flags = (
+   count => [], sum => [ '--sum' ], print => [ '--print' ],
+);
+
+###############################################################################
+## ----------------------------------------------------------------------------
+## Parse command-line arguments.
+##
+###############################################################################
+
+my $engines_arg = 'algorithm3,primesieve,primeutil';
+my $ranges_arg;
+my $modes_arg   = 'count,sum,print';
+my $sieve_arg   = 'auto';
+my $workers_arg = '1,auto';
+my $repeat      = 3;
+my $format_arg  = 'json';
+my $output_file = '';
+my @range_args;
+
+my ($help_flag, $quiet_flag);
+
+{
+   local $SIG{__WARN__} = sub {
+      print STDERR "$prog_name: ", $_[0];
+   };
+
+   my $result = GetOptions(
+      'engines=s'                 => \$engines_arg,
+      'format=s'                  => \$format_arg,
+      'modes=s'                   => \$modes_arg,
+      'output=s'                  => \$output_file,
+      'range=s'                   => \@range_args,
+      'ranges=s'                  => \$ranges_arg,
+      'repeat=i'                  => \$repeat,
+      'sieve-sizes|sievesizes=s'  => \$sieve_arg,
+      'workers|maxworkers=s'      => \$workers_arg,
+
+      'h|help'  => \$help_flag,
+      'q|quiet' => \$quiet_flag
+   );
+
+   usage() if not $result;
+   usage() if $help_flag;
+}
+
+sub split_list { return grep { length } split /\s*,\s*/, $_[0]; }
+
+my @engine_names = split_list($engines_arg);
+## The default ranges are run unless only --range is given.
+
+$ranges_arg = (@range_args ? '' : 'low,2^32,1e12,2^64')
+   unless defined $ranges_arg;
+
+my @range_names  = split_list($ranges_arg);
+my @modes        = split_list($modes_arg);
+my @sieve_sizes  = split_list($sieve_arg);
+my @workers      = split_list($workers_arg);
+
+for my $name (@engine_names) {
+   next if exists $engines{$name};
+   print STDERR "$prog_name: $name: unknown engine\n";
+   exit 2;
+}
+
+for my $name (@range_names) {
+   next if exists $ranges{$name};
+   print STDERR "$prog_name: $name: unknown range\n";
+   exit 2;
+}
+
+for my $range (@range_args) {
+   my ($from, $to) = split /:/, $range, 2;
+   ($from, $to) = ('1', $from) unless defined $to;
+   $ranges{$range} = [ $from, $to ];
+   push @range_names, $range;
+}
+
+for my $mode (@modes) {
+   next if $mode =~ /^(?:count|sum|print)$/;
+   print STDERR "$prog_name: $mode: invalid mode\n";
+   exit 2;
+}
+
+for my $size (@sieve_sizes) {
+   next if $size eq 'auto' || (looks_like_number($size) && $size > 0);
+   print STDERR "$prog_name: $size: invalid sieve size\n";
+   exit 2;
+}
+
+for my $val (@workers) {
+   next if $val =~ /^auto/ || (looks_like_number($val) && $val > 0);
+   print STDERR "$prog_name: $val: invalid max workers\n";
+   exit 2;
+}
+
+if ($repeat < 1) {
+   print STDERR "$prog_name: $repeat: invalid repeat count\n";
+   exit 2;
+}
+
+if ($format_arg ne 'json' && $format_arg ne 'csv') {
+   print STDERR "$prog_name: $format_arg: invalid format\n";
+   exit 2;
+}
+
+## Engines needing a module are skipped if it is not installed.
+
+@engine_names = grep {
+   my $module = $engines{$_}{module};
+   my $ok = !$module || qx{"$^X" -M$module -e "print 1" 2>&1} eq '1';
+   print STDERR "$prog_name: skipping $_, $module not found\n" unless $ok;
+   $ok;
+} @engine_names;
+
+###############################################################################
+## ----------------------------------------------------------------------------
+## Run a script once. Returns the exit status, wall time, the compute time
+## and result reported by the script, and the last error line, if any.
+##
+###############################################################################
+
+sub run_once
+{
+   my ($script, @args) = @_;
+   my ($err_fh, $err_file) = tempfile('benchXXXXXX', TMPDIR => 1, UNLINK => 1);
+   my ($status, $compute, $result, $error, $start, $lapse, $pid);
+
+   $start = time();
+
+   ## The child leaves by _exit on failure; exit or die would run the END
+   ## blocks and File::Temp cleanup, removing the parent's temp files.
+   if (($pid = fork()) == 0) {
+      open STDOUT, '>', '/dev/null' or child_fail("/dev/null: $!");
+      open STDERR, '>&', $err_fh    or child_fail("$err_file: $!");
+      exec { $^X } $^X, "$base_dir/bin/$script", @args
+         or child_fail("$script: $!");
+   }
+
+   die "$prog_name: cannot fork: $!\n" unless defined $pid;
+
+   waitpid($pid, 0), $status = $? >> 8;
+   $lapse = time() - $start;
+
+   seek $err_fh, 0, 0;
+
+   while (my $line = <$err_fh>) {
+      ## Progress is written with carriage returns.
+      $line = (split /\r/, $line)[-1] // '';
+      chomp $line;
+
+      if ($line =~ /^Compute time\s+:\s+([\d.]+) sec/) {
+         $compute = $1 + 0;
+      }
+      elsif ($line =~ /^(?:Prime numbers|Sum of primes)\s+:\s+(\d+)/) {
+         $result = $1;
+      }
+      elsif ($line =~ /\S/) {
+         $error = $line;
+      }
+   }
+
+   close $err_fh;
+   unlink $err_file;
+
+   return ($status, $lapse, $compute, $result, $error);
+}
+
+## Report a failure in the forked child and leave without cleanup.
+
+sub child_fail
+{
+   syswrite(\*STDERR, "$prog_name: $_[0]\n");
+   POSIX::_exit(255);
+}
+
+## The number of primes in a range, counted by algorithm3.pl.
+
+sub prime_count
+{
+   my ($from, $to) = @_;
+   my ($status, $lapse, $compute, $result, $error) =
+      run_once('algorithm3.pl', $from, $to);
+
+   return ($status <= 1 && defined $result) ? 0 + $result : undef;
+}
+
+sub min
+{
+   my $min = shift;
+   for (@_) { $min = $_ if $_ < $min; }
+
+   return $min;
+}
+
+sub median
+{
+   my @v = sort { $a <=> $b } @_;
+   my $n = scalar @v;
+
+   return ($n % 2) ? $v[$n / 2] : ($v[$n / 2 - 1] + $v[$n / 2]) / 2;
+}
+
+sub round { return (defined $_[0]) ? 0 + sprintf("%.$_[1]f", $_[0]) : undef; }
+
+###############################################################################
+## ----------------------------------------------------------------------------
+## Run the matrix.
+##
+###############################################################################
+
+my %mode_flags = @mode_flags;
+my (@results, %n_primes, %base_rate);
+
+## Compile the C code first, so the one time delay is not timed.
+
+my %warmed;
+
+for my $name (@engine_names) {
+   my $script = $engines{$name}{script};
+   next if $warmed{$script}++;
+   print STDERR "warming up $script\n" unless $quiet_flag;
+   run_once($script, '1e3');
+}
+
+for my $range (@range_names) {
+   my ($from, $to) = @{ $ranges{$range} };
+
+   print STDERR "counting primes in $range\n" unless $quiet_flag;
+   $n_primes{$range} = prime_count($from, $to);
+
+   for my $name (@engine_names) {
+      my $engine = $engines{$name};
+
+      for my $mode (@modes) {
+         next unless exists $engine->{args}{$mode};
+
+         for my $size ($engine->{sieve_size} ? @sieve_sizes : ('auto')) {
+            for my $val (@workers) {
+               my (@args, @wall, @compute, %row);
+               my ($status, $lapse, $compute, $result, $error, $n, $rate);
+
+               push @args, @{ $engine->{args}{$mode} };
+               push @args, @{ $mode_flags{$mode} };
+               push @args, "--sieve-size=$size" if $size ne 'auto';
+               push @args, "--maxworkers=$val", $from, $to;
+
+               print STDERR "$name $mode $range size=$size workers=$val\n"
+                  unless $quiet_flag;
+
+               for (1 .. $repeat) {
+                  ($status, $lapse, $compute, $result, $error) =
+                     run_once($engine->{script}, @args);
+
+                  last if $status > 1;
+
+                  push @wall, $lapse;
+                  push @compute, $compute if defined $compute;
+               }
+
+               $n = MCE::_parse_max_workers($val);
+
+               %row = (
+                  engine => $name, range => $range, from => $from, to => $to,
+                  mode => $mode, sieve_size => $size, max_workers => "$val",
+                  n_workers => $n, runs => scalar @wall,
+                  status => ($status > 1) ? 'error' : 'ok',
+                  error => ($status > 1) ? $error : undef,
+                  result => $result, primes => $n_primes{$range},
+               );
+
+               if (@wall) {
+                  $row{wall_min}    = round(min(@wall), 3);
+                  $row{wall_median} = round(median(@wall), 3);
+               }
+               if (@compute) {
+                  $row{compute_min}    = round(min(@compute), 3);
+                  $row{compute_median} = round(median(@compute), 3);
+               }
+
+               ## Counts must agree with algorithm3.pl.
+               if ($mode eq 'count' && $row{status} eq 'ok' &&
+                     defined $result && defined $n_primes{$range} &&
+                     $result ne $n_primes{$range}) {
+                  $row{status} = 'mismatch';
+               }
+
+               ## Rates use the compute time, else the wall time.
+               my $secs = $row{compute_min} // $row{wall_min};
+
+               if ($row{status} eq 'ok' && $secs && defined $n_primes{$range}) {
+                  $rate = $n_primes{$range} / $secs;
+                  $row{primes_per_sec} = round($rate, 0);
+                  $row{per_worker} = round($rate / $n, 0);
+
+                  my $key = join($;, $name, $range, $mode, $size);
+                  $base_rate{$key} = $rate if $n == 1;
+                  $row{_key} = $key;
+               }
+
+               push @results, \%row;
+            }
+         }
+      }
+   }
+}
+
+## Efficiency per worker, relative to 1 worker in the same combination.
+
+for my $row (@results) {
+   my $key = delete $row->{_key};
+   next unless defined $key && $base_rate{$key};
+   $row->{efficiency} = round(
+      $row->{primes_per_sec} / $row->{n_workers} / $base_rate{$key}, 3
+   );
+}
+
+###############################################################################
+## ----------------------------------------------------------------------------
+## Output results.
+##
+###############################################################################
+
+my @fields = qw(
+   engine range from to mode sieve_size max_workers n_workers runs
+   wall_min wall_median compute_min compute_median primes primes_per_sec
+   per_worker efficiency result status error
+);
+
+my $out_fh = \*STDOUT;
+
+if (length $output_file) {
+   open $out_fh, '>', $output_file or
+      die "$prog_name: cannot open '$output_file' for writing\n";
+}
+
+if ($format_arg eq 'csv') {
+   print {$out_fh} join(',', @fields), "\n";
+
+   for my $row (@results) {
+      print {$out_fh} join(',', map {
+         my $v = $row->{$_} // '';
+         $v =~ s/"/""/g, $v = "\"$v\"" if $v =~ /[,"\n]/;
+         $v;
+      } @fields), "\n";
+   }
+}
+else {
+   my $json = JSON::PP->new->canonical->pretty;
+
+   print {$out_fh} $json->encode({
+      host => {
+         ncpu => MCE::Util::get_ncpu(), os => $^O,
+         perl => sprintf("%vd", $^V), time => time(),
+      },
+      repeat  => $repeat,
+      results => \@results,
+   });
+}
+
+close $out_fh if length $output_file;
+
+exit 0;
+
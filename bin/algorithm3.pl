@@ -38,6 +38,7 @@ BEGIN {
 use Getopt::Long qw(:config bundling no_ignore_case no_auto_abbrev);
 use Scalar::Util qw(looks_like_number);
 use Time::HiRes  qw(sleep time);
+use IO::Select;
 
 use MCE::Signal  qw($tmp_dir -use_dev_shm);
 use MCE;
@@ -82,18 +83,50 @@ DESCRIPTION
 
    The following options are available:
 
+   --build-index        extend the index file through NUMBER (with --index)
+   --cache=<file>       keep the sieving primes in file for later runs
+   --format=<val>       print format text, uint64, or delta (default text)
+   --index=<file>       count or sum from the index file, sieving the ends
    --maxworkers=<val>   specify the number of workers (default auto)
+   --merge              combine the shard records given, in place of numbers
+   --method=<val>       count by auto, sieve, or lmo (prime counting function)
+   --native-threads     run workers as C threads, not via MCE (no progress)
+   --numa               pin workers to cores, spread across NUMA nodes
+   --output=<file>      print primes to file, written in parallel by offset
+   --record=<file>      write the partial result of a shard to file
+   --server             answer count and sum queries, one per line of STDIN
+   --shard=<I/N>        run part I of N of the range (requires --record)
+   --shared-results     add up counts and sums in shared memory, not gathered
+   --sieve-size=<val>   multiple of 510510 per block (default auto by L2)
+   --socket=<path>      answer queries on a Unix socket (implies --server)
+   --stats              report the time per phase and per worker to STDERR
+   --stride=<val>       numbers between index entries (default 2^32)
    --usethreads         spawn workers via threads if available (not fork)
+   --wheel=<val>        sieve engine by wheel 6 (Algorithm3) or 30 (default 6)
    --help,  -h          display this help and exit
    --print, -p          print primes (ignored if sum is specified)
    --quiet, -q          suppress progress including extra output
-   --sum,   -s          sum primes (maximum N allowed 29505444490)
+   --sum,   -s          sum primes (128 bits, otherwise maximum N 29505444490)
+
+   The prime counting function (lmo) does not use --numa or --shared-results,
+   so --method=auto counts by sieving when either is given; with lmo given,
+   they are ignored with a warning.
 
 EXAMPLES
    $prog_name 17446744073000000000 17446744073709551609
    $prog_name --maxworkers=auto/2 1000000000
    $prog_name 22801763489 --sum
    $prog_name 1e5 3e5 --print
+   $prog_name 1e9 --print --format=delta > primes.bin
+   $prog_name 1e9 --output=primes.out
+   $prog_name 1e19 1e19+1e6 --cache=/var/tmp/a3.cache
+   $prog_name 1e10 --method=sieve --wheel=30
+   $prog_name 1e12 --method=sieve --sum --shared-results
+   echo "sum 1e9 1001000000" | $prog_name --server 1e12
+   $prog_name --index=/var/tmp/a3.index --build-index 1e13
+   $prog_name --index=/var/tmp/a3.index 123456789 9876543210123
+   $prog_name --shard=2/8 --record=/nfs/job/2.rec 1e14
+   $prog_name --merge /nfs/job/*.rec
 
 EXIT STATUS
    The $prog_name utility exits with one of the following values:
@@ -115,9 +148,31 @@ EXIT STATUS
 
 my ($print_flag, $quiet_flag, $sum_flag, $run_mode) = (0, 0, 0, MODE_COUNT);
 
+my $cache_file  = '';
+my $format_arg  = 'text';
+my $index_file;
 my $max_workers = 'auto';
 my $max_number  = 18446744073709551609;   ## 2^64 - 1 - 6
+my $method_arg  = 'auto';
+my $sieve_arg   = 'auto';
+my $stride_arg;
+my $wheel_arg   = 6;
 my $use_threads;
+my $output_fmt;
+my $mem_fd;
+my $native_flag;
+my $build_flag;
+my $numa_flag;
+my $server_flag;
+my $shared_flag;
+my $shard_arg;
+my ($shard_i, $n_shards);
+my $record_file;
+my $merge_flag;
+my $socket_path;
+my $stats_flag;
+my $output_file;
+my $output_pos = 0;
 
 {
    local $@; no warnings;
@@ -125,8 +180,26 @@ my $use_threads;
    my $help_flag = 0;
 
    my $result = GetOptions(
-      'maxworkers|max-workers=s' => \$max_workers,
-      'usethreads|use-threads'   => \$use_threads,
+      'buildindex|build-index'       => \$build_flag,
+      'cache=s'                      => \$cache_file,
+      'format=s'                     => \$format_arg,
+      'index=s'                      => \$index_file,
+      'maxworkers|max-workers=s'     => \$max_workers,
+      'merge'                        => \$merge_flag,
+      'method=s'                     => \$method_arg,
+      'nativethreads|native-threads' => \$native_flag,
+      'numa'                         => \$numa_flag,
+      'output=s'                     => \$output_file,
+      'record=s'                     => \$record_file,
+      'server'                       => \$server_flag,
+      'shard=s'                      => \$shard_arg,
+      'sharedresults|shared-results' => \$shared_flag,
+      'sievesize|sieve-size=s'       => \$sieve_arg,
+      'socket=s'                     => \$socket_path,
+      'stats'                        => \$stats_flag,
+      'stride=s'                     => \$stride_arg,
+      'usethreads|use-threads'       => \$use_threads,
+      'wheel=s'                      => \$wheel_arg,
 
       'h|help'  => \$help_flag,
       'p|print' => \$print_flag,
@@ -147,12 +220,92 @@ my $use_threads;
       }
    }
 
+   if ($sieve_arg ne 'auto') {
+      $sieve_arg = sprintf("%u", eval $sieve_arg);
+      if (!$sieve_arg || $sieve_arg % 510510 || $sieve_arg > 510510 * 64) {
+         print STDERR "$prog_name: $sieve_arg: invalid sieve size\n";
+         exit 2;
+      }
+   }
+
+   $output_fmt = {
+      text => FORMAT_TEXT, uint64 => FORMAT_UINT64, delta => FORMAT_DELTA
+   }->{ lc $format_arg };
+
+   if (not defined $output_fmt) {
+      print STDERR "$prog_name: $format_arg: invalid format\n";
+      exit 2;
+   }
+
+   if ($method_arg !~ /^(?:auto|sieve|lmo)$/) {
+      print STDERR "$prog_name: $method_arg: invalid method\n";
+      exit 2;
+   }
+
+   $stride_arg = sprintf("%u", eval $stride_arg) if defined $stride_arg;
+
+   if (defined $stride_arg && $stride_arg < 510510) {
+      print STDERR "$prog_name: $stride_arg: invalid stride\n";
+      exit 2;
+   }
+
+   if ($build_flag && !defined $index_file) {
+      print STDERR "$prog_name: --build-index requires --index\n";
+      exit 2;
+   }
+
+   if ($wheel_arg !~ /^(?:6|30)$/) {
+      print STDERR "$prog_name: $wheel_arg: invalid wheel\n";
+      exit 2;
+   }
+
+   ## A server takes queries up to NUMBER (default the maximum allowed),
+   ## quietly.
+   $server_flag = 1 if defined $socket_path;
+
+   if ($server_flag) {
+      @ARGV = ($max_number) unless defined $ARGV[0];
+      @ARGV = ($ARGV[-1]), $quiet_flag = 1;
+      $print_flag = $sum_flag = 0;
+   }
+
    usage() unless defined $ARGV[0];
 
+   ## Merging takes record files for arguments; the mode is in the records.
+   last if $merge_flag;
+
+   $print_flag = 1 if defined $output_file;
+
    $run_mode = MODE_PRINT if $print_flag;
    $run_mode = MODE_SUM   if $sum_flag;
+
+   if (defined $shard_arg) {
+      ($shard_i, $n_shards) = $shard_arg =~ m{^(\d+)/(\d+)$};
+
+      if (!defined $shard_i || $shard_i < 1 || $shard_i > $n_shards) {
+         print STDERR "$prog_name: $shard_arg: invalid shard\n";
+         exit 2;
+      }
+      if ($server_flag || defined $index_file) {
+         print STDERR "$prog_name: --shard cannot be used with ",
+            ($server_flag ? "--server" : "--index"), "\n";
+         exit 2;
+      }
+      if (!defined $record_file) {
+         print STDERR "$prog_name: --shard requires --record\n";
+         exit 2;
+      }
+      if ($run_mode == MODE_PRINT && !defined $output_file) {
+         print STDERR "$prog_name: --shard with --print requires --output\n";
+         exit 2;
+      }
+   }
 }
 
+## Merge the records of a sharded run, then exit.
+
+exit merge_records(@ARGV) if $merge_flag;
+
 ## Validation.
 
 my $F_arg = (defined $ARGV[1]) ? $ARGV[0] : 1;
@@ -164,19 +317,106 @@ my $N_arg = (defined $ARGV[1]) ? $ARGV[1] : $ARGV[0];
    $N_arg = sprintf("%u", eval $N_arg);
 }
 
-Sandbox::check_numbers($prog_name, $max_number, $F_arg, $N_arg, $sum_flag);
+## Without 128-bit sums in C, the sum of primes is limited to 64 bits.
+
+Sandbox::check_numbers(
+   $prog_name, $max_number, $F_arg, $N_arg, $sum_flag,
+   (sum_bits() > 64) ? 0 : undef
+);
 
 my $F = $F_arg + 0;
 my $N = $N_arg + 0;
 
+## With --shard=I/N, only part I of [FROM, NUMBER] is run, as if given as
+## the range. The run is the same on any host; see Sandbox::shard_range.
+
+my ($F_all, $N_all) = ($F, $N);
+
+if (defined $shard_arg) {
+   ($F, $N) = Sandbox::shard_range($F_all, $N_all, $shard_i, $n_shards);
+
+   if ($F > $N) {
+      open STDOUT, '>', $output_file if $run_mode == MODE_PRINT;
+      shard_record(0);
+      exit Sandbox::end($quiet_flag, $run_mode, 0);
+   }
+}
+
+## Counting by the prime counting function, pi(N) - pi(F - 1), takes about
+## N^(2/3) steps rather than N - F. It is limited to N <= 1e19, the range
+## of the is_prime array.
+
+my $lmo_flag = 0;
+
+## It runs without --numa and --shared-results, so auto sieves with them.
+
+if ($run_mode == MODE_COUNT && $method_arg ne 'sieve') {
+   if ($N > 1e19) {
+      if ($method_arg eq 'lmo') {
+         print STDERR "$prog_name: method lmo requires NUMBER <= 1e19\n";
+         exit 2;
+      }
+   }
+   elsif ($method_arg eq 'lmo') {
+      print STDERR "$prog_name: warning: --numa and --shared-results are ",
+         "ignored with method lmo\n" if $numa_flag || $shared_flag;
+      $lmo_flag = 1;
+   }
+   elsif ($N - $F > 32 * $N ** (2/3)) {
+      $lmo_flag = 1 unless $numa_flag || $shared_flag;
+   }
+}
+
+## An index holds the cumulative count and sum at each multiple of the
+## stride. Building extends it through the last multiple <= NUMBER; its
+## own stride is kept (default 2^32). A query sieves the ends only.
+
+my ($F_b, $N_b, $N_pre) = (1, 0, $N);
+
+if (defined $index_file) {
+   if ($run_mode == MODE_PRINT || $server_flag) {
+      print STDERR "$prog_name: --index requires count or sum mode\n";
+      exit 2;
+   }
+
+   my ($stride, $n_entries) = @{ index_load($index_file) };
+
+   if ($stride == 0) {
+      if (-e $index_file) {
+         print STDERR "$prog_name: $index_file: invalid index file\n";
+         exit 2;
+      }
+      if (!$build_flag) {
+         print STDERR "$prog_name: $index_file: no such index file\n";
+         exit 2;
+      }
+      $stride = $stride_arg // 4294967296, $n_entries = 0;
+      index_new($stride);
+   }
+   elsif (defined $stride_arg && $stride_arg != $stride) {
+      print STDERR "$prog_name: $index_file: stride is $stride\n";
+      exit 2;
+   }
+
+   $stride_arg = $stride, $lmo_flag = 0;
+
+   ($F_b, $N_b) = ($n_entries * $stride + 1, $N - $N % $stride);
+   $N_b = 0 unless $build_flag;
+
+   ## A query may sieve up to the entry above NUMBER.
+   $N_pre = ($max_number - $N < $stride) ? $max_number : $N + $stride;
+}
+
 ###############################################################################
 ## ----------------------------------------------------------------------------
 ## Include C functions.
 ##
 ## Specifying -std=c99 fails under the Windows environment due to several
 ## header files not c99 compliant. The -march=native option is not supported
-## by the MinGW compiler. Update ExtUtils::MakeMaker if compiling fails
-## under Cygwin. Specify CCFLAGSEX, not CCFLAGS.
+## by the MinGW compiler; the sieve kernels are compiled per ISA level and
+## chosen at load instead (see Kernels in algorithm3.c). Update
+## ExtUtils::MakeMaker if compiling fails under Cygwin. Specify CCFLAGSEX,
+## not CCFLAGS.
 ##
 ###############################################################################
 
@@ -188,6 +428,7 @@ BEGIN {
 use Inline 'C' => Config =>
    CCFLAGSEX => "-I${base_dir}/src -O2 -fsigned-char -fomit-frame-pointer",
    TYPEMAPS => "${base_dir}/src/typemap",
+   LIBS => (($^O eq 'MSWin32') ? '' : '-lpthread'),
    clean_after_build => 0;
 
 use Inline 'C' => "${base_dir}/src/algorithm3.c";
@@ -198,72 +439,656 @@ use Inline 'C' => "${base_dir}/src/algorithm3.c";
 ##
 ###############################################################################
 
-## Step size must be a multiple of 6. Sieve size requires a multiple of 510510
-## for the pre-sieve logic: (2)(3) pre-sieves (5)(7)(11)(13)(17).
-## Do not increase beyond the maximum below.
+## Step size must be a multiple of 510510, not necessarily the sieve size.
+## Sieve size requires a multiple of 510510 for the pre-sieve logic: (2)(3)
+## pre-sieves (5)(7)(11)(13)(17). Do not increase beyond 510510 * 64.
+## The C function walks a chunk in sieve size blocks.
+##
+## A block of 510510 numbers occupies 21271.25 bytes (1 bit per 3 numbers).
+## By default, size the block to half the L2 cache. The smallest primes
+## are sieved in L1 sized pieces of the block.
 
-my ($F_adj, $sieve_size, $step_size);
+my ($F_adj, $sieve_size, $step_size, $l1d_size, $l2_size, $n_workers);
 
 $F_adj = $F - ($F % 6) - 6 + 1;
 $F_adj = 1 if $F_adj < 1;
 
-$sieve_size = 510510 * 8;
+($l1d_size, $l2_size) = Sandbox::cache_sizes();
+
+$sieve_size = ($sieve_arg ne 'auto') ? $sieve_arg
+   : 510510 * Sandbox::min(64, int($l2_size / 2 / 21271.25) || 1);
 $step_size  = $sieve_size * int(($N + 1 - $F_adj) / $sieve_size / 5e4 + 1);
 
+## Large sieving primes are distributed into buckets once per chunk, at a
+## cost of roughly sqrt(N) / sieve_size blocks. Give high ranges more
+## blocks per chunk, while keeping at least two chunks per worker.
+
+$n_workers = MCE::_parse_max_workers($max_workers);
+
+{
+   my $n_blocks  = int(($N + 1 - $F_adj) / $sieve_size) + 1;
+   my $n_steps   = Sandbox::min(
+      int(sqrt($N) / $sieve_size), int($n_blocks / ($n_workers * 2))
+   );
+
+   $step_size = $sieve_size * $n_steps
+      if ($sieve_size * $n_steps > $step_size);
+}
+
+## Outside print mode, a worker is handed the chunk after its last one
+## when possible, resuming the sieving offsets left by that chunk.
+
+my $affinity = ($run_mode == MODE_PRINT) ? 0 : 1;
+
+## With --stats, each worker times its chunks: in C (practicalsieve_stats),
+## and sending output and gathering results in Perl. It reports once done.
+
+my %w_stats;
+
+my $o_iter = Sandbox::o_iter(
+   $F_adj, $N, $step_size, $quiet_flag, $run_mode, $affinity
+);
+my $i_iter = Sandbox::i_iter($F_adj, $N, $step_size,
+   ($run_mode == MODE_PRINT) ? 0 : $n_workers, $affinity);
+
+## With --shared-results, workers add their counts or sums to a slot each
+## in shared memory (practicalsieve_slots_init, run below) rather than
+## gathering every chunk. The manager polls the slots for progress and for
+## the chunk ends as hints, each time a worker asks for a chunk, and adds
+## them up at the end.
+
+$shared_flag = 0 if $run_mode == MODE_PRINT;
+
+if ($shared_flag) {
+   my $p_iter = Sandbox::p_iter($F_adj, $N, $quiet_flag);
+   my ($next_iter, $n_done, %seen) = ($i_iter, 0);
+
+   $i_iter = sub {
+      my ($done, @next) = @{ practicalsieve_slots_poll() };
+
+      $p_iter->($done - $n_done), $n_done = $done;
+      Sandbox::i_hints(grep { $_ && !$seen{$_}++ } @next) if $affinity;
+
+      return $next_iter->();
+   };
+}
+
 my $mce = MCE->new(
 
-   gather => Sandbox::o_iter($F_adj, $N, $step_size, $quiet_flag, $run_mode),
-   input_data => Sandbox::i_iter($F_adj, $N, $step_size),
+   gather => !$stats_flag ? $o_iter : sub {
+      my $t = time();
+      $o_iter->(@_);
+      Sandbox::stats_add('gather', time() - $t);
+   },
+
+   input_data => $i_iter,
 
    max_workers => (($F == $N) ? 1 : $max_workers),
    use_threads => $use_threads,
-   init_relay  => 1,
+   init_relay  => 0,
+
+   ## Print mode writes each chunk to a memory file per worker, then sends
+   ## it to STDOUT in chunk order. Otherwise, fall back to temp files.
+   ## With --output, the relay only passes along the running byte offset
+   ## and workers write their chunks into the file concurrently.
+
+   ## With --numa, each worker is pinned before touching any memory, and
+   ## worker processes switch to their node's copy of the sieving tables.
+
+   user_begin => sub {
+      practicalsieve_numa_bind(MCE->wid, $use_threads ? 0 : 1) if $numa_flag;
+      practicalsieve_slot_bind(MCE->wid) if $shared_flag;
+      $mem_fd = ($run_mode == MODE_PRINT) ? output_open() : -1;
+
+      %w_stats = map { $_ => 0 } qw( busy send gather );
+      $w_stats{t_begin} = $w_stats{t_last} = time();
+   },
+
+   user_end => sub {
+      output_close($mem_fd) if $mem_fd >= 0;
+      practicalsieve_slot_bind(0) if $shared_flag;
+
+      MCE->do('Sandbox::stats_worker',
+         MCE->wid, \%w_stats, practicalsieve_stats()) if $stats_flag;
+
+      practicalsieve_release();
+   },
 
    user_func => sub {
       my ($mce, $chunk_ref, $chunk_id) = @_;
-      my ($start, $n_agg, $output_fd) = ($chunk_ref->[0], 0, 0);
-      my ($limit, $low, $high, $output_fh);
+      my ($start, $limit) = @{ $chunk_ref };
+      my ($n_agg, $output_fd, $n_len) = (0, 0, $limit - $start + 1);
+      my ($output_fh, @ret, $t1, $t2);
+      my $t0 = time();
 
-      if ($run_mode == MODE_PRINT) {
+      if ($run_mode == MODE_PRINT && $mem_fd >= 0) {
+         $output_fd = $mem_fd;
+      }
+      elsif ($run_mode == MODE_PRINT) {
          open $output_fh, ">", "$tmp_dir/$chunk_id" or
             die "$prog_name: cannot open '$tmp_dir/$chunk_id' for writing\n";
 
          $output_fd = fileno $output_fh;
       }
 
-      $limit = ($max_number - $start <= $step_size)
-         ? $N : Sandbox::min($start + $step_size - 1, $N);
+      my $p = practicalsieve_chunk($start, $limit, $run_mode, $output_fd);
+      $t1 = time();
+
+      if ($run_mode != MODE_PRINT) {
+         $n_agg = $p->[0];
+      }
+      elsif ($p->[0] < 0) {
+         MCE->abort();
+      }
+
+      if ($run_mode == MODE_PRINT && $mem_fd >= 0 && $output_pos) {
+         my $n_bytes = output_size($mem_fd);
+         my $offset  = MCE::relay { $_ += $n_bytes };
+         my $n_sent  = output_pwrite($mem_fd, fileno STDOUT, $offset);
+         MCE->abort() if $n_sent < 0;
+         @ret = ($n_len, $chunk_id, $n_sent);
+      }
+      elsif ($run_mode == MODE_PRINT && $mem_fd >= 0) {
+         my $n_sent;
+         MCE::relay {
+            syswrite(\*STDERR, "      \r") if $chunk_id == 1 &&
+               !$quiet_flag && output_size($mem_fd) > 0;
+            $n_sent = output_send($mem_fd, fileno STDOUT);
+         };
+         MCE->abort() if $n_sent < 0;
+         @ret = ($n_len, $chunk_id, $n_sent);
+      }
+      elsif ($run_mode == MODE_PRINT) {
+         close $output_fh;
+         MCE::relay { Sandbox::display($chunk_id, "$tmp_dir/$chunk_id") };
+         @ret = ($n_len, $chunk_id);
+      }
+      else {
+         @ret = ($n_len, $n_agg);
+      }
+
+      $t2 = time();
+
+      MCE->gather(@ret, ($affinity ? $limit : ())) if !$shared_flag;
+
+      if ($stats_flag) {
+         my $t3 = time();
+         $w_stats{busy} += $t3 - $t0, $w_stats{t_last} = $t3;
+         $w_stats{send} += $t2 - $t1, $w_stats{gather} += $t3 - $t2;
+      }
+
+      return;
+   }
+);
+
+## Prime counting function. Workers sieve [1, z] for the special leaves and
+## P2 in chunks. The results are merged in chunk order by the manager.
+
+sub prime_count
+{
+   my ($x) = @_;
+   my $z = primecount_init($x);
+
+   if ($z > 0) {
+      my ($order_id, %tmp) = (1);
+      my $step = 524288 * int($z / 524288 / 5e3 + 1);
+      my $o_iter = Sandbox::o_iter(1, $z, $step, $quiet_flag, MODE_COUNT);
+
+      MCE->new(
+         gather => sub {
+            my ($chunk_id, $n_len, $packed) = @_;
+
+            $o_iter->($n_len, 0);
+            $tmp{$chunk_id} = $packed;
+
+            while (exists $tmp{$order_id}) {
+               primecount_merge(delete $tmp{$order_id++});
+            }
+
+            return;
+         },
+
+         input_data  => Sandbox::i_iter(1, $z, $step, $n_workers),
+         max_workers => $max_workers,
+         use_threads => $use_threads,
+
+         user_func => sub {
+            my ($mce, $chunk_ref, $chunk_id) = @_;
+            my ($lo, $hi) = @{ $chunk_ref };
+
+            MCE->gather($chunk_id, $hi - $lo + 1, primecount_chunk($lo, $hi));
+
+            return;
+         }
+      )->run();
+   }
+
+   my $n = primecount_result()->[0];
+   primecount_free();
+
+   return $n;
+}
+
+## Build the index from F through N, both at stride boundaries. Workers
+## count and sum one stride at a time. The manager appends the strides in
+## order, saving the file each minute so an interrupted build resumes.
+
+sub index_write
+{
+   if (index_save($index_file) != 0) {
+      print STDERR "$prog_name: cannot write '$index_file'\n";
+      exit 2;
+   }
+
+   return;
+}
 
-      for ($low = $start; $low <= $limit; $low += $sieve_size) {
+sub build_index
+{
+   my ($F, $N) = @_;
+   my ($next, $t_save, %tmp) = ($F, time());
+   my $o_iter = Sandbox::o_iter($F, $N, $stride_arg, $quiet_flag, MODE_COUNT);
 
-         $high = ($max_number - $low <= $sieve_size)
-            ? $limit : Sandbox::min($low + $sieve_size - 1, $limit);
+   MCE->new(
+      gather => sub {
+         my ($start, $count, $sum) = @_;
 
-         my $p = practicalsieve($low, $high, $run_mode, $output_fd);
+         $tmp{$start} = [ $count, $sum ];
 
-         if ($run_mode != MODE_PRINT) {
-            $n_agg += $p->[0];
+         while (exists $tmp{$next}) {
+            index_append(@{ delete $tmp{$next} });
+            $o_iter->($stride_arg, 0);
+            $next += $stride_arg;
          }
-         elsif ($p->[0] < 0) {
-            MCE->abort();
-            last;
+
+         if (time() - $t_save >= 60) {
+            index_write(), $t_save = time();
+         }
+
+         return;
+      },
+
+      input_data  => Sandbox::i_iter($F, $N, $stride_arg, $n_workers),
+      max_workers => $max_workers,
+      use_threads => $use_threads,
+
+      user_func => sub {
+         my ($mce, $chunk_ref, $chunk_id) = @_;
+         my ($lo, $hi) = @{ $chunk_ref };
+
+         for (my $s = $lo; ; $s += $stride_arg) {
+            MCE->gather($s, @{ index_chunk($s, $s + $stride_arg - 1) });
+            last if $hi - $s < $stride_arg;
          }
 
-         last if ($limit - $low < $sieve_size);
+         return;
       }
+   )->run();
 
-      if ($run_mode == MODE_PRINT) {
-         close $output_fh;
-         MCE::relay { Sandbox::display($chunk_id, "$tmp_dir/$chunk_id") };
-         MCE->gather($chunk_id);
+   index_write();
+
+   return;
+}
+
+
+## Server mode. Answer "[count|sum] [FROM] NUMBER" queries, one per line,
+## from STDIN or the clients of a Unix socket, with the sieving primes
+## kept from one precalc and a pool of workers kept between batches. The
+## lines read together form a batch. Small batches are sieved here; the
+## others are split into pieces across the workers. Each answer is a line
+## holding the result, or "error: " and the reason.
+
+## A number is one term or terms joined by + or -, as on the command line
+## (1e9+1000), evaluated term by term rather than by a string eval.
+
+sub serve_number
+{
+   my ($arg) = @_;
+   my $term = qr/\d+(?:\.\d+)?(?:e\d+)?/i;
+   my $val  = 0;
+
+   return unless $arg =~ /^$term(?:[-+]$term)*$/;
+
+   while ($arg =~ /([-+]?)($term)/g) {
+      my $t = sprintf("%u", $2);
+
+      if ($1 eq '-') {
+         return if $t > $val;
+         $val -= $t;
       }
       else {
-         MCE->gather($n_agg);
+         $val += $t;
       }
+   }
 
-      return;
+   return sprintf("%u", $val);
+}
+
+sub serve_parse
+{
+   my ($line) = @_;
+   my $mode = ($line =~ s/^\s*(count|sum)\b//) ? $1 : 'count';
+   my @args = map { scalar serve_number($_) } split ' ', $line;
+
+   return (undef, "invalid query")
+      if @args < 1 || @args > 2 || grep { !defined } @args;
+
+   my $f = (@args == 2) ? $args[0] : 1;
+   my $n = $args[-1];
+
+   local $@;
+
+   eval {
+      Sandbox::check_numbers(
+         'query', $N, $f, $n, ($mode eq 'sum'), (sum_bits() > 64) ? 0 : undef
+      );
+   };
+
+   if ($@) {
+      (my $err = $@) =~ s/^query: |\.?\n$//g;
+      return (undef, $err);
+   }
+
+   return ([ ($mode eq 'sum') ? MODE_SUM : MODE_COUNT, $f, $n ]);
+}
+
+sub serve
+{
+   my (@conns, @batch, @tasks, @acc, $listener);
+   my $sel = IO::Select->new();
+   my $inline_max = $sieve_size * 4;
+
+   local $SIG{PIPE} = 'IGNORE';
+
+   if (defined $socket_path) {
+      require IO::Socket::UNIX;
+      unlink $socket_path if -S $socket_path;
+
+      $listener = IO::Socket::UNIX->new(
+         Type => Socket::SOCK_STREAM(), Local => $socket_path, Listen => 64
+      ) or die "$prog_name: cannot listen on '$socket_path': $!\n";
+
+      $sel->add($listener);
+   }
+   else {
+      push @conns, { in => \*STDIN, out => \*STDOUT, buf => '' };
+      $sel->add(\*STDIN);
+   }
+
+   my $mce = MCE->new(
+      gather => sub {
+         my ($qid, $n) = @_;
+         $acc[$qid] = Sandbox::add_dec($acc[$qid], $n);
+      },
+
+      chunk_size  => 1,
+      max_workers => $max_workers,
+      use_threads => $use_threads,
+
+      user_end => sub {
+         practicalsieve_release();
+      },
+
+      user_func => sub {
+         my ($mce, $chunk_ref, $chunk_id) = @_;
+         my ($qid, $mode, $lo, $hi) = @{ $chunk_ref->[0] };
+
+         MCE->gather($qid, practicalsieve_chunk($lo, $hi, $mode, -1)->[0]);
+
+         return;
+      }
+   );
+
+   ## Spawn the workers before accepting clients, so the workers do not
+   ## hold the client sockets open.
+   $mce->spawn() if $n_workers > 1;
+
+   while (@conns || $listener) {
+      @batch = ();
+
+      ## Read what is available from every client ready, then take the
+      ## complete lines, or the remainder at end of input.
+
+      for my $fh ($sel->can_read()) {
+         if (defined $listener && $fh == $listener) {
+            my $client = $listener->accept() or next;
+            push @conns, { in => $client, out => $client, buf => '' };
+            $sel->add($client);
+            next;
+         }
+
+         my ($conn) = grep { $_->{in} == $fh } @conns;
+         my $n_read = sysread($fh, $conn->{buf}, 65536, length $conn->{buf});
+
+         $conn->{eof} = 1 if !$n_read;
+      }
+
+      for my $conn (@conns) {
+         while ($conn->{buf} =~ s/^([^\n]*)\n//) {
+            push @batch, [ $conn, $1 ];
+         }
+         if ($conn->{eof} && length $conn->{buf}) {
+            push @batch, [ $conn, $conn->{buf} ], $conn->{buf} = '';
+         }
+      }
+
+      ## Parse. Queries wider than a few blocks, when the batch is large
+      ## enough, are split into pieces of at least one block.
+
+      my ($n_nums, @query) = (0);
+
+      for my $i (0 .. $#batch) {
+         next if $batch[$i][1] !~ /\S/;
+         my ($q, $err) = serve_parse($batch[$i][1]);
+         $query[$i] = $q // $err;
+         $n_nums += $q->[2] - $q->[1] + 1 if defined $q;
+      }
+
+      @tasks = (), @acc = ();
+
+      for my $i (0 .. $#batch) {
+         my $q = $query[$i];
+         next unless ref $q;
+
+         my ($mode, $f, $n) = @{ $q };
+         $acc[$i] = 0;
+
+         if ($n_nums <= $inline_max || $n_workers == 1) {
+            $acc[$i] = practicalsieve_chunk($f, $n, $mode, -1)->[0];
+            next;
+         }
+
+         my $n_pieces = Sandbox::min(
+            int(($n - $f + 1) / $sieve_size) || 1, $n_workers * 2
+         );
+         my $size = int(($n - $f + 1) / $n_pieces);
+
+         for my $k (1 .. $n_pieces) {
+            my $hi = ($k == $n_pieces) ? $n : $f + $size - 1;
+            push @tasks, [ $i, $mode, $f, $hi ];
+            $f = $hi + 1;
+         }
+      }
+
+      $mce->process(\@tasks) if @tasks;
+
+      ## Answer in the order asked, per client.
+
+      my %out;
+
+      for my $i (0 .. $#batch) {
+         next unless defined $query[$i];
+         my $conn = $batch[$i][0];
+         $out{$conn} .= ref $query[$i]
+            ? "$acc[$i]\n" : "error: $query[$i]\n";
+         $conn->{answer} = 1;
+      }
+
+      for my $conn (@conns) {
+         if (delete $conn->{answer}) {
+            syswrite($conn->{out}, delete $out{$conn}) or $conn->{eof} = 1;
+         }
+
+         next unless $conn->{eof};
+
+         $sel->remove($conn->{in});
+         close $conn->{in} if defined $listener;
+      }
+
+      @conns = grep { !$_->{eof} } @conns;
+   }
+
+   $mce->shutdown();
+   practicalsieve_release();
+
+   return;
+}
+
+###############################################################################
+## ----------------------------------------------------------------------------
+## Shards. Each shard of a run writes a record of its part (--record); the
+## merge checks that the records cover every shard of the same run, adds
+## up their results, and in print mode appends their output files in order
+## to --output or STDOUT.
+##
+###############################################################################
+
+sub shard_record
+{
+   my ($lapse) = @_;
+
+   my %rec = (
+      shard => "$shard_i/$n_shards", from => $F_all, number => $N_all,
+      lo => $F, hi => $N, format => lc $format_arg,
+      mode => { MODE_COUNT() => 'count', MODE_SUM() => 'sum',
+                MODE_PRINT() => 'print' }->{ $run_mode },
+      result => $Sandbox::N_agg, seconds => sprintf("%0.03f", $lapse)
+   );
+
+   if ($run_mode == MODE_PRINT) {
+      $rec{output} = abs_path($output_file);
+      $rec{bytes}  = -s $output_file || 0;
+   }
+
+   if (!Sandbox::record_write($record_file, \%rec)) {
+      print STDERR "$prog_name: cannot write '$record_file'\n";
+      exit 2;
+   }
+
+   return;
+}
+
+sub merge_records
+{
+   my (@paths) = @_;
+   my (@recs, $first, $out_fh, $buf, $lapse);
+
+   for my $path (@paths) {
+      my $rec = Sandbox::record_read($path);
+
+      if (!$rec) {
+         print STDERR "$prog_name: $path: invalid record\n";
+         return 2;
+      }
+
+      $first //= $rec;
+
+      for my $key (qw( n_shards from number mode format )) {
+         next if $rec->{$key} eq $first->{$key};
+         print STDERR "$prog_name: $path: not from the same run\n";
+         return 2;
+      }
+
+      if (defined $recs[ $rec->{i} ]) {
+         print STDERR "$prog_name: $path: shard $rec->{shard} repeated\n";
+         return 2;
+      }
+
+      $recs[ $rec->{i} ] = $rec;
+   }
+
+   for my $i (1 .. $first->{n_shards}) {
+      if (!defined $recs[$i]) {
+         print STDERR "$prog_name: shard $i/$first->{n_shards} missing\n";
+         return 2;
+      }
+
+      my ($lo, $hi) = Sandbox::shard_range(
+         $first->{from} + 0, $first->{number} + 0, $i, $first->{n_shards}
+      );
+
+      if ($recs[$i]{lo} ne $lo || $recs[$i]{hi} ne $hi) {
+         print STDERR "$prog_name: shard $i/$first->{n_shards}: range ",
+            "differs from $lo..$hi\n";
+         return 2;
+      }
+   }
+
+   shift @recs;
+
+   $run_mode = { count => MODE_COUNT, sum => MODE_SUM, print => MODE_PRINT }
+      ->{ $first->{mode} } // MODE_COUNT;
+
+   if ($run_mode == MODE_PRINT) {
+      if (defined $output_file) {
+         if (!open $out_fh, '>', $output_file) {
+            print STDERR "$prog_name: cannot open '$output_file' for ",
+               "writing\n";
+            return 2;
+         }
+      }
+      else {
+         $out_fh = \*STDOUT;
+      }
+
+      binmode $out_fh;
+
+      for my $rec (@recs) {
+         next unless $rec->{bytes};
+
+         my ($in_fh, $n_read);
+
+         if (!open($in_fh, '<', $rec->{output}) ||
+               -s $in_fh != $rec->{bytes}) {
+            print STDERR "$prog_name: $rec->{output}: missing or not ",
+               "$rec->{bytes} bytes\n";
+            return 2;
+         }
+
+         binmode $in_fh;
+
+         while ($n_read = sysread($in_fh, $buf, 1048576)) {
+            syswrite($out_fh, $buf, $n_read) == $n_read or do {
+               print STDERR "$prog_name: could not write the output\n";
+               return 2;
+            };
+         }
+
+         close $in_fh;
+      }
+
+      close $out_fh if defined $output_file;
    }
-);
+
+   ## The shards ran side by side, so the time is of the slowest.
+   $lapse = 0;
+
+   for my $rec (@recs) {
+      if ($run_mode == MODE_SUM) {
+         Sandbox::add_sum($rec->{result});
+      }
+      elsif ($run_mode == MODE_COUNT) {
+         $Sandbox::N_agg += $rec->{result};
+      }
+      else {
+         $Sandbox::N_agg = 1 if $rec->{result};
+      }
+
+      $lapse = $rec->{seconds} if $rec->{seconds} > $lapse;
+   }
+
+   return Sandbox::end($quiet_flag, $run_mode, $lapse);
+}
 
 ###############################################################################
 ## ----------------------------------------------------------------------------
@@ -274,11 +1099,91 @@ my $mce = MCE->new(
 syswrite(\*STDERR, "  0%\r") unless $quiet_flag;
 my $start = time();
 
-practicalsieve_precalc($F_adj, $F, $N, $sieve_size);
+## The sieving primes are computed by native threads, one per worker.
+## Both engines (wheel 6 or 30) share them. A server sieves by the mod-30
+## wheel, since its queries begin anywhere.
+
+set_wheel($server_flag ? 30 : $wheel_arg);
+
+if (defined $index_file) {
+   practicalsieve_precalc(
+      1, 1, $N_pre, $sieve_size, $l1d_size, $cache_file, $n_workers
+   );
+}
+else {
+   practicalsieve_precalc(
+      $F_adj, $F, $N, $sieve_size, $l1d_size, $cache_file, $n_workers
+   );
+}
+
+if ($stats_flag) {
+   Sandbox::stats_add('precalc', time() - $start);
+   set_stats(1);
+}
+
+if (defined $output_file) {
+   if (not open STDOUT, '>', $output_file) {
+      print STDERR "$prog_name: cannot open '$output_file' for writing\n";
+      exit 2;
+   }
+   $output_pos = -f STDOUT ? 1 : 0;
+}
+
+set_output_format($output_fmt);
+binmode STDOUT if $output_fmt != FORMAT_TEXT;
+
+if ($server_flag) {
+   serve();
+   practicalsieve_memfree();
+   exit(0);
+}
+elsif (defined $index_file) {
+   build_index($F_b, $N_b) if $N_b >= $F_b;
+
+   $Sandbox::N_agg = index_query($F, $N, $run_mode, $n_workers)->[0];
+   index_free();
+}
+elsif ($native_flag) {
+   syswrite(\*STDERR, "      \r") if $run_mode == MODE_PRINT && !$quiet_flag;
+
+   my $p = practicalsieve_parallel(
+      $F_adj, $N, $step_size, $run_mode, fileno(STDOUT), $output_pos,
+      ($numa_flag ? 1 : 0), (($F == $N) ? 1 : $n_workers)
+   );
+
+   Sandbox::stats_worker(1, undef, practicalsieve_stats()) if $stats_flag;
+
+   if ($run_mode != MODE_PRINT) {
+      $Sandbox::N_agg = $p->[0];
+   }
+   else {
+      $Sandbox::N_agg = ($p->[0] < 0) ? 0 : $p->[1];
+      exit 2 if $p->[0] < 0;
+   }
+}
+elsif ($lmo_flag) {
+   $Sandbox::N_agg  = prime_count($N);
+   $Sandbox::N_agg -= prime_count($F - 1) if $F > 2;
+}
+else {
+   practicalsieve_numa_init() if $numa_flag;
+   $shared_flag = practicalsieve_slots_init($n_workers) if $shared_flag;
+   $mce->run();
 
-$mce->run();
+   $Sandbox::N_agg = practicalsieve_slots_reduce()->[0] if $shared_flag;
+}
 
 practicalsieve_memfree();
 
-exit(Sandbox::end($quiet_flag, $run_mode, time() - $start));
+{
+   my $t_end = time();
+   my $status = Sandbox::end($quiet_flag, $run_mode, $t_end - $start);
+
+   Sandbox::stats_report($t_end - $start, $t_end, practicalsieve_isa())
+      if $stats_flag;
+
+   shard_record($t_end - $start) if defined $shard_arg;
+
+   exit($status);
+}
 
@@ -78,18 +78,22 @@ DESCRIPTION
 
    The following options are available:
 
+   --format=<val>       print format text, uint64, or delta (default text)
    --maxworkers=<val>   specify the number of workers (default auto)
+   --output=<file>      print primes to file, written in parallel by offset
    --usethreads         spawn workers via threads if available (not fork)
    --help,  -h          display this help and exit
    --print, -p          print primes (ignored if sum is specified)
    --quiet, -q          suppress progress including extra output
-   --sum,   -s          sum primes (maximum N allowed 29505444490)
+   --sum,   -s          sum primes (128 bits, otherwise maximum N 29505444490)
 
 EXAMPLES
    $prog_name 17446744073000000000 17446744073709551609
    $prog_name --maxworkers=auto/2 1000000000
    $prog_name 22801763489 --sum
    $prog_name 1e5 3e5 --print
+   $prog_name 1e9 --print --format=delta > primes.bin
+   $prog_name 1e9 --output=primes.out
 
 EXIT STATUS
    The $prog_name utility exits with one of the following values:
@@ -111,9 +115,14 @@ EXIT STATUS
 
 my ($print_flag, $quiet_flag, $sum_flag, $run_mode) = (0, 0, 0, MODE_COUNT);
 
+my $format_arg  = 'text';
 my $max_workers = 'auto';
 my $max_number  = 18446744030759878656;   ## 2^64 - 2^32 * 10
 my $use_threads;
+my $output_fmt;
+my $mem_fd;
+my $output_file;
+my $output_pos = 0;
 
 {
    local $@; no warnings;
@@ -121,7 +130,9 @@ my $use_threads;
    my $help_flag = 0;
 
    my $result = GetOptions(
+      'format=s'                 => \$format_arg,
       'maxworkers|max-workers=s' => \$max_workers,
+      'output=s'                 => \$output_file,
       'usethreads|use-threads'   => \$use_threads,
 
       'h|help'  => \$help_flag,
@@ -143,8 +154,19 @@ my $use_threads;
       }
    }
 
+   $output_fmt = {
+      text => FORMAT_TEXT, uint64 => FORMAT_UINT64, delta => FORMAT_DELTA
+   }->{ lc $format_arg };
+
+   if (not defined $output_fmt) {
+      print STDERR "$prog_name: $format_arg: invalid format\n";
+      exit 2;
+   }
+
    usage() unless defined $ARGV[0];
 
+   $print_flag = 1 if defined $output_file;
+
    $run_mode = MODE_PRINT if $print_flag;
    $run_mode = MODE_SUM   if $sum_flag;
 }
@@ -160,7 +182,12 @@ my $N_arg = (defined $ARGV[1]) ? $ARGV[1] : $ARGV[0];
    $N_arg = sprintf("%u", eval $N_arg);
 }
 
-Sandbox::check_numbers($prog_name, $max_number, $F_arg, $N_arg, $sum_flag);
+## Without 128-bit sums in C, the sum of primes is limited to 64 bits.
+
+Sandbox::check_numbers(
+   $prog_name, $max_number, $F_arg, $N_arg, $sum_flag,
+   (sum_bits() > 64) ? 0 : undef
+);
 
 my $F = $F_arg + 0;
 my $N = $N_arg + 0;
@@ -204,33 +231,52 @@ my ($F_adj, $sieve_size, $step_size);
 $F_adj = $F - ($F % 6) - 6 + 1;
 $F_adj = 1 if $F_adj < 1;
 
-$sieve_size = 510510 * 30;
+## Sum and print modes stream the primes of a block through an iterator,
+## in memory independent of the block size, so blocks may be large.
+
+$sieve_size = 510510 * 128;
 $step_size  = $sieve_size * int(($N + 1 - $F_adj) / $sieve_size / 5e4 + 1);
 
 my $mce = MCE->new(
 
    gather => Sandbox::o_iter($F, $N, $step_size, $quiet_flag, $run_mode),
-   input_data => Sandbox::i_iter($F, $N, $step_size),
+   input_data => Sandbox::i_iter($F, $N, $step_size,
+      ($run_mode == MODE_PRINT) ? 0 : MCE::_parse_max_workers($max_workers)),
 
    max_workers => (($F == $N) ? 1 : $max_workers),
    use_threads => $use_threads,
-   init_relay  => 1,
+   init_relay  => 0,
+
+   ## Print mode writes each chunk to a memory file per worker, then sends
+   ## it to STDOUT in chunk order. Otherwise, fall back to temp files.
+   ## With --output, the relay only passes along the running byte offset
+   ## and workers write their chunks into the file concurrently.
+
+   user_begin => sub {
+      $mem_fd = ($run_mode == MODE_PRINT) ? output_open() : -1;
+   },
+
+   user_end => sub {
+      output_close($mem_fd) if $mem_fd >= 0;
+      primesieve_release();
+   },
 
    user_func => sub {
       my ($mce, $chunk_ref, $chunk_id) = @_;
-      my ($start, $n_agg, $output_fd) = ($chunk_ref->[0], 0, 0);
-      my ($limit, $low, $high, $output_fh);
+      my ($start, $limit) = @{ $chunk_ref };
+      my ($n_agg, $output_fd, $n_len) = (0, 0, $limit - $start + 1);
+      my ($low, $high, $output_fh, @n_sum);
 
-      if ($run_mode == MODE_PRINT) {
+      if ($run_mode == MODE_PRINT && $mem_fd >= 0) {
+         $output_fd = $mem_fd;
+      }
+      elsif ($run_mode == MODE_PRINT) {
          open $output_fh, ">", "$tmp_dir/$chunk_id" or
             die "$prog_name: cannot open '$tmp_dir/$chunk_id' for writing\n";
 
          $output_fd = fileno $output_fh;
       }
 
-      $limit = ($max_number - $start <= $step_size)
-         ? $N : Sandbox::min($start + $step_size - 1, $N);
-
       for ($low = $start; $low <= $limit; $low += $sieve_size) {
 
          $high = ($max_number - $low <= $sieve_size)
@@ -238,7 +284,10 @@ my $mce = MCE->new(
 
          my $p = primesieve($low, $high, $run_mode, $output_fd);
 
-         if ($run_mode != MODE_PRINT) {
+         if ($run_mode == MODE_SUM) {
+            push @n_sum, $p->[0];
+         }
+         elsif ($run_mode != MODE_PRINT) {
             $n_agg += $p->[0];
          }
          elsif ($p->[0] < 0) {
@@ -249,13 +298,33 @@ my $mce = MCE->new(
          last if ($limit - $low < $sieve_size);
       }
 
-      if ($run_mode == MODE_PRINT) {
+      if ($run_mode == MODE_PRINT && $mem_fd >= 0 && $output_pos) {
+         my $n_bytes = output_size($mem_fd);
+         my $offset  = MCE::relay { $_ += $n_bytes };
+         my $n_sent  = output_pwrite($mem_fd, fileno STDOUT, $offset);
+         MCE->abort() if $n_sent < 0;
+         MCE->gather($n_len, $chunk_id, $n_sent);
+      }
+      elsif ($run_mode == MODE_PRINT && $mem_fd >= 0) {
+         my $n_sent;
+         MCE::relay {
+            syswrite(\*STDERR, "      \r") if $chunk_id == 1 &&
+               !$quiet_flag && output_size($mem_fd) > 0;
+            $n_sent = output_send($mem_fd, fileno STDOUT);
+         };
+         MCE->abort() if $n_sent < 0;
+         MCE->gather($n_len, $chunk_id, $n_sent);
+      }
+      elsif ($run_mode == MODE_PRINT) {
          close $output_fh;
          MCE::relay { Sandbox::display($chunk_id, "$tmp_dir/$chunk_id") };
-         MCE->gather($chunk_id);
+         MCE->gather($n_len, $chunk_id);
+      }
+      elsif ($run_mode == MODE_SUM) {
+         MCE->gather($n_len, @n_sum);
       }
       else {
-         MCE->gather($n_agg);
+         MCE->gather($n_len, $n_agg);
       }
 
       return;
@@ -271,6 +340,17 @@ my $mce = MCE->new(
 syswrite(\*STDERR, "  0%\r") unless $quiet_flag;
 my $start = time();
 
+if (defined $output_file) {
+   if (not open STDOUT, '>', $output_file) {
+      print STDERR "$prog_name: cannot open '$output_file' for writing\n";
+      exit 2;
+   }
+   $output_pos = -f STDOUT ? 1 : 0;
+}
+
+set_output_format($output_fmt);
+binmode STDOUT if $output_fmt != FORMAT_TEXT;
+
 $mce->run();
 
 exit(Sandbox::end($quiet_flag, $run_mode, time() - $start));
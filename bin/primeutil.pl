@@ -189,7 +189,8 @@ $step_size  = $sieve_size * int(($N + 1 - $F_adj) / $sieve_size / 5e4 + 1);
 my $mce = MCE->new(
 
    gather => Sandbox::o_iter($F, $N, $step_size, $quiet_flag, $run_mode),
-   input_data => Sandbox::i_iter($F, $N, $step_size),
+   input_data => Sandbox::i_iter($F, $N, $step_size,
+      ($run_mode == MODE_PRINT) ? 0 : MCE::_parse_max_workers($max_workers)),
 
    max_workers => (($F == $N) ? 1 : $max_workers),
    use_threads => $use_threads,
@@ -197,8 +198,9 @@ my $mce = MCE->new(
 
    user_func => sub {
       my ($mce, $chunk_ref, $chunk_id) = @_;
-      my ($start, $n_agg, $output_fd) = ($chunk_ref->[0], 0, 0);
-      my ($limit, $low, $high, $output_fh);
+      my ($start, $limit) = @{ $chunk_ref };
+      my ($n_agg, $output_fd, $n_len) = (0, 0, $limit - $start + 1);
+      my ($low, $high, $output_fh);
 
       if ($run_mode == MODE_PRINT) {
          open $output_fh, ">", "$tmp_dir/$chunk_id" or
@@ -207,9 +209,6 @@ my $mce = MCE->new(
          $output_fd = fileno $output_fh;
       }
 
-      $limit = ($max_number - $start <= $step_size)
-         ? $N : Sandbox::min($start + $step_size - 1, $N);
-
       for ($low = $start; $low <= $limit; $low += $sieve_size) {
 
          $high = ($max_number - $low <= $sieve_size)
@@ -234,10 +233,10 @@ my $mce = MCE->new(
       if ($run_mode == MODE_PRINT) {
          close $output_fh;
          MCE::relay { Sandbox::display($chunk_id, "$tmp_dir/$chunk_id") };
-         MCE->gather($chunk_id);
+         MCE->gather($n_len, $chunk_id);
       }
       else {
-         MCE->gather($n_agg);
+         MCE->gather($n_len, $n_agg);
       }
 
       return;
@@ -15,7 +15,11 @@ use Fcntl qw(O_RDONLY);
 use constant {
    MODE_COUNT => 1,
    MODE_PRINT => 2,
-   MODE_SUM   => 3
+   MODE_SUM   => 3,
+
+   FORMAT_TEXT   => 0,
+   FORMAT_UINT64 => 1,
+   FORMAT_DELTA  => 2
 };
 
 sub import {
@@ -24,6 +28,10 @@ sub import {
    *{ $pkg . '::MODE_COUNT' } = \&MODE_COUNT;
    *{ $pkg . '::MODE_PRINT' } = \&MODE_PRINT;
    *{ $pkg . '::MODE_SUM'   } = \&MODE_SUM;
+
+   *{ $pkg . '::FORMAT_TEXT'   } = \&FORMAT_TEXT;
+   *{ $pkg . '::FORMAT_UINT64' } = \&FORMAT_UINT64;
+   *{ $pkg . '::FORMAT_DELTA'  } = \&FORMAT_DELTA;
    return;
 }
 
@@ -39,9 +47,12 @@ our $N_agg = 0;
 ##
 ###############################################################################
 
+## The sum_max argument defaults to 29505444490, the largest N whose sum
+## of primes fits in 64 bits. Pass 0 if sums are not bounded.
+
 sub check_numbers
 {
-   my ($prog_name, $max_number, $F_arg, $N_arg, $sum_flag) = @_;
+   my ($prog_name, $max_number, $F_arg, $N_arg, $sum_flag, $sum_max) = @_;
 
    local $@; no warnings;
 
@@ -56,8 +67,10 @@ sub check_numbers
       unless looks_like_number($N_arg) &&
          $N_arg >= $F_arg && int($N_arg) == $N_arg;
 
-   die "$prog_name: sum: number 29505444490 is the maximum allowed.\n"
-      if $sum_flag && $N_arg > 29505444490;
+   $sum_max = 29505444490 unless defined $sum_max;
+
+   die "$prog_name: sum: number $sum_max is the maximum allowed.\n"
+      if $sum_flag && $sum_max && $N_arg > $sum_max;
 
    die "$prog_name: number $max_number is the maximum allowed.\n"
       if min($max_number, $N_arg) ne $N_arg;
@@ -65,47 +78,264 @@ sub check_numbers
    return;
 }
 
+###############################################################################
+## ----------------------------------------------------------------------------
+## Probe the L1 data and L2 cache sizes in bytes. Falls back to common
+## values when the OS does not tell.
+##
+###############################################################################
+
+sub cache_sizes
+{
+   my ($l1d_sz, $l2_sz) = (32768, 262144);
+   my $dir = '/sys/devices/system/cpu/cpu0/cache';
+
+   local $@; no warnings;
+
+   my $slurp = sub {
+      my ($fh, $val);
+      open $fh, '<', $_[0] or return '';
+      chomp($val = <$fh>); close $fh;
+      return $val;
+   };
+
+   if (-d $dir) {
+      for my $idx (glob "$dir/index*") {
+         my $level = $slurp->("$idx/level");
+         my $type  = $slurp->("$idx/type");
+         my $size  = $slurp->("$idx/size");
+
+         next unless $type =~ /^(?:Data|Unified)$/;
+         next unless $size =~ /^(\d+)([KMG]?)$/i;
+
+         $size = $1 * { '' => 1, K => 1024, M => 1024**2, G => 1024**3 }
+            ->{ uc $2 };
+
+         $l1d_sz = $size if $level == 1;
+         $l2_sz  = $size if $level == 2;
+      }
+   }
+   elsif ($^O eq 'darwin') {
+      my $l1d = qx(sysctl -n hw.l1dcachesize 2>/dev/null); chomp $l1d;
+      my $l2  = qx(sysctl -n hw.l2cachesize  2>/dev/null); chomp $l2;
+
+      $l1d_sz = $l1d if looks_like_number($l1d) && $l1d > 0;
+      $l2_sz  = $l2  if looks_like_number($l2)  && $l2  > 0;
+   }
+
+   return ($l1d_sz, $l2_sz);
+}
+
 ###############################################################################
 ## ----------------------------------------------------------------------------
 ## Input/output iterators for MCE.
 ##
 ###############################################################################
 
+## Each chunk is a (start, limit) pair. Given the number of workers, use
+## guided self-scheduling: a chunk covers the remaining range divided by
+## twice the number of workers, rounded down to a multiple of step_size.
+## Chunks start large and shrink to step_size near the end, so the last
+## chunks finish about the same time. Otherwise, chunks are step_size.
+##
+## With affinity, the range is split into one span per worker instead,
+## each handed out in order. A worker gathers the end of its chunk with
+## its result, which o_iter passes to i_done before the worker asks for
+## another, and is given the chunk continuing its span, so the sieving
+## offsets carry over. Once its span is done, a worker takes the back
+## half of the largest span remaining. Chunks are then out of order, so
+## not for print mode.
+
+my @i_hints;
+
+sub i_done
+{
+   @i_hints = ($_[0] + 1);
+
+   return;
+}
+
+## With --shared-results, workers do not report to the manager. It passes
+## the chunk ends noted in the result slots since the last request as the
+## candidates instead, as the requesting worker is likely among them.
+
+sub i_hints
+{
+   @i_hints = @_;
+
+   return;
+}
+
 sub i_iter
 {
-   my ($F, $N, $step_size) = @_;
-   my $n_seq;
+   my ($F, $N, $step_size, $n_workers, $affinity) = @_;
+   my ($n_seq, $done) = ($F, 0);
+
+   return i_iter_spans($F, $N, $step_size, $n_workers)
+      if ($affinity && $n_workers && $n_workers > 1);
 
    return sub {
-      return $n_seq = $F if (not $n_seq);
-      return if ($n_seq + $step_size > $N);
-      return $n_seq += $step_size;
+      my ($start, $size, $limit) = ($n_seq, $step_size);
+      return if $done;
+
+      if ($n_workers) {
+         my $n_steps = int(($N - $start) / $step_size / ($n_workers * 2));
+         $size = $step_size * $n_steps if $n_steps > 1;
+      }
+
+      if ($N - $start < $size) {
+         $limit = $N, $done = 1;
+      } else {
+         $limit = $start + $size - 1, $n_seq = $limit + 1;
+      }
+
+      return ($start, $limit);
    }
 }
 
-sub o_iter
+sub i_iter_spans
 {
-   my ($F, $N, $step_size, $quiet_flag, $run_mode) = @_;
+   my ($F, $N, $step_size, $n_workers) = @_;
+   my ($n_steps, $span_size, @spans);
 
-   my ($completed, $inc, $progress) = (1, 99.0, 0.0);
-   my $show_progress = $quiet_flag ? 0 : 1;
-   my ($file, $last_progress);
+   ## Spans are [ next, end, started ], starting at multiples of step_size.
+   $n_steps = int(($N - $F) / $step_size / $n_workers);
+   $span_size = $step_size * ($n_steps > 1 ? $n_steps : 1);
+
+   for my $id (1 .. $n_workers) {
+      if ($id == $n_workers || $N - $F < $span_size) {
+         push @spans, [ $F, $N, 0 ];
+         last;
+      }
+      push @spans, [ $F, $F + $span_size - 1, 0 ];
+      $F += $span_size;
+   }
 
-   $inc = 99.0 / (($N - $F) / $step_size) if ($N - $F >= $step_size);
+   @i_hints = ();
 
    return sub {
+      my ($span, $start, $limit, $size, $n_left);
+      return unless @spans;
+
+      for my $hint (@i_hints) {
+         ($span) = grep { $_->[0] == $hint } @spans;
+         last if $span;
+      }
+
+      @i_hints = ();
+
+      ($span) = grep { !$_->[2] } @spans unless $span;
+
+      if (!$span) {
+         my ($big) = sort { $b->[1] - $b->[0] <=> $a->[1] - $a->[0] } @spans;
+         my $n_half = int(($big->[1] - $big->[0] + 1) / $step_size / 2);
 
-      if ($show_progress) {
-         $progress += $inc;
-         if (!defined $last_progress || $last_progress != int($progress)) {
-            $last_progress = int($progress);
-            syswrite(\*STDERR, "  $last_progress%\r");
+         if ($n_half >= 1) {
+            $span = [ $big->[0] + $step_size * $n_half, $big->[1], 0 ];
+            $big->[1] = $span->[0] - 1;
+            push @spans, $span;
+         } else {
+            $span = $big;
          }
       }
 
-      if ($run_mode != MODE_PRINT) {
+      $n_left = 0;
+      $n_left += $_->[1] - $_->[0] + 1 for @spans;
+
+      $n_steps = int($n_left / $step_size / ($n_workers * 2));
+      $size = ($n_steps > 1) ? $step_size * $n_steps : $step_size;
+
+      ($start, $span->[2]) = ($span->[0], 1);
+
+      if ($span->[1] - $start < $size) {
+         $limit = $span->[1];
+         @spans = grep { $_ != $span } @spans;
+      } else {
+         $limit = $start + $size - 1, $span->[0] = $limit + 1;
+      }
+
+      return ($start, $limit);
+   }
+}
+
+## Sums of primes may exceed 2^64, given as decimal strings. Add them in
+## base 1e18, as a high and a low integer, avoiding bigint.
+
+sub add_dec
+{
+   my ($x, $y) = @_;
+   my ($hi, $lo) = (0, 0);
+
+   for my $n ($x, $y) {
+      if (length $n > 18) {
+         $hi += substr($n, 0, -18);
+         $lo += substr($n, -18);
+      }
+      else {
+         $lo += $n;
+      }
+   }
+
+   if ($lo >= 1000000000000000000) {
+      $lo -= 1000000000000000000;
+      $hi += 1;
+   }
+
+   return $hi ? sprintf("%u%018u", $hi, $lo) : $lo;
+}
+
+sub add_sum
+{
+   $N_agg = add_dec($N_agg, $_[0]);
+
+   return;
+}
+
+## Progress display, given the length of each range done.
+
+sub p_iter
+{
+   my ($F, $N, $quiet_flag) = @_;
+
+   my $progress = 0.0;
+   my $last_progress;
+
+   return sub { } if $quiet_flag;
+
+   return sub {
+      $progress += 99.0 * $_[0] / ($N - $F + 1);
+      if (!defined $last_progress || $last_progress != int($progress)) {
+         $last_progress = int($progress);
+         syswrite(\*STDERR, "  $last_progress%\r");
+      }
+
+      return;
+   };
+}
+
+## The first value gathered is the length of the chunk, for progress.
+## With affinity, the last is the end of the chunk, for i_iter_spans.
+
+sub o_iter
+{
+   my ($F, $N, $step_size, $quiet_flag, $run_mode, $affinity) = @_;
+
+   my $p_iter = p_iter($F, $N, $quiet_flag);
+   my $file;
+
+   return sub {
+      $p_iter->(shift);
+      i_done(pop) if $affinity;
+
+      if ($run_mode == MODE_SUM) {
+         add_sum($_) for @_;
+      }
+      elsif ($run_mode != MODE_PRINT) {
          $N_agg += $_[0];
       }
+      elsif (@_ > 1) {
+         $N_agg = 1 if $_[1] > 0;
+      }
       else {
          $file = MCE->tmp_dir() . "/$_[0]";
          $N_agg = 1 if -s $file;
@@ -116,6 +346,96 @@ sub o_iter
    };
 }
 
+###############################################################################
+## ----------------------------------------------------------------------------
+## Sharding a run across hosts (--shard=I/N), and the records merged after.
+##
+###############################################################################
+
+## The range [F_adj, N] is cut at multiples of SHARD_UNIT from F_adj, the
+## largest sieve size, rather than at step_size, which depends on the host
+## (L2 size, number of workers). Shard I of S takes units from
+## floor((I - 1) * n / S) to floor(I * n / S), clipped to FROM and NUMBER.
+## A shard may be empty (lo > hi).
+
+use constant SHARD_UNIT => 510510 * 64;
+
+sub shard_range
+{
+   my ($F, $N, $shard, $n_shards) = @_;
+   my ($F_adj, $len, $n_units, $k_lo, $k_hi, $lo, $hi);
+
+   $F_adj = $F - ($F % 6) - 6 + 1;
+   $F_adj = 1 if $F_adj < 1;
+
+   ## Whole units first, as a quotient of exact multiples is exact.
+   $len = $N - $F_adj + 1;
+   $n_units = ($len - $len % SHARD_UNIT) / SHARD_UNIT;
+   $n_units += 1 if $len % SHARD_UNIT;
+
+   $k_lo = ($shard - 1) * $n_units;
+   $k_lo = ($k_lo - $k_lo % $n_shards) / $n_shards;
+   $k_hi = $shard * $n_units;
+   $k_hi = ($k_hi - $k_hi % $n_shards) / $n_shards;
+
+   $lo = ($k_lo == 0) ? $F : $F_adj + $k_lo * SHARD_UNIT;
+   $hi = ($shard == $n_shards) ? $N : $F_adj + $k_hi * SHARD_UNIT - 1;
+   $hi = $N if min($N, $hi) eq $N;
+
+   return ($lo, $hi);
+}
+
+## A record is one "key value" per line, for shard I/S of FROM..NUMBER: the
+## range lo..hi, mode, format, result (count, sum, or 1 if printed any),
+## run time, and in print mode the output file and its size in bytes.
+
+my @record_keys = qw(
+   shard from number lo hi mode format result seconds output bytes
+);
+
+sub record_write
+{
+   my ($path, $rec) = @_;
+   my $fh;
+
+   open $fh, '>', "$path.tmp" or return 0;
+
+   print {$fh} "# algorithm3.pl shard record\n";
+   print {$fh} "version 1\n";
+
+   for my $key (@record_keys) {
+      print {$fh} "$key $rec->{$key}\n" if defined $rec->{$key};
+   }
+
+   close $fh or return 0;
+
+   return rename "$path.tmp", $path;
+}
+
+sub record_read
+{
+   my ($path) = @_;
+   my ($fh, %rec);
+
+   open $fh, '<', $path or return;
+
+   while (my $line = <$fh>) {
+      next if $line =~ /^\s*(?:#|$)/;
+      chomp $line;
+      my ($key, $val) = split ' ', $line, 2;
+      $rec{$key} = $val // '';
+   }
+
+   close $fh;
+
+   return unless ($rec{version} // '') eq '1';
+   return unless ($rec{shard} // '') =~ m{^(\d+)/(\d+)$};
+
+   @rec{qw( i n_shards )} = ($1, $2);
+
+   return \%rec;
+}
+
 ###############################################################################
 ## ----------------------------------------------------------------------------
 ## Display prime numbers to STDOUT.
@@ -142,6 +462,96 @@ sub display
    }
 }
 
+###############################################################################
+## ----------------------------------------------------------------------------
+## Timing per phase and per worker (--stats).
+##
+###############################################################################
+
+## The manager adds its own phases with stats_add. Each worker reports once,
+## when done, with stats_worker (via MCE->do): its Perl side timings in
+## seconds, and the rows of C timers in nanoseconds from practicalsieve_stats
+## [ sieve, count, format, write, blocks, chunks, busy, tail ]. Without the
+## Perl timings, busy and tail come from the row (native threads).
+
+my (%stats_phase, @stats_rows);
+
+sub stats_add
+{
+   $stats_phase{$_[0]} += $_[1];
+
+   return;
+}
+
+sub stats_worker
+{
+   my ($wid, $perl, $c_rows) = @_;
+
+   for my $r (@{ $c_rows }) {
+      my %row = (
+         wid    => $wid++,
+         sieve  => $r->[0] / 1e9, count  => $r->[1] / 1e9,
+         format => $r->[2] / 1e9, write  => $r->[3] / 1e9,
+         blocks => $r->[4],       chunks => $r->[5],
+      );
+
+      if ($perl) {
+         $row{$_} = $perl->{$_} for qw( busy send gather t_begin t_last );
+      }
+      else {
+         $row{busy} = $row{sieve} + $row{count} + $row{format} + $row{write};
+         $row{idle} = $r->[6] / 1e9 - $row{busy};
+         $row{tail} = $r->[7] / 1e9;
+      }
+
+      push @stats_rows, \%row;
+   }
+
+   return;
+}
+
+## Busy is the time spent on chunks, idle the time waiting for them, and
+## tail the time from a worker's last chunk to the end of the run.
+
+sub stats_report
+{
+   my ($lapse, $t_end, $isa) = @_;
+   my @cols = qw( sieve count format write send gather busy idle tail );
+   my (%total, $row);
+
+   printf STDERR "Stats\n";
+   printf STDERR "  %-12s %9.03f sec\n", $_, $stats_phase{$_}
+      for sort keys %stats_phase;
+   printf STDERR "  %-12s %9.03f sec\n", 'run', $lapse;
+   printf STDERR "  %-12s %9s\n", 'kernels', $isa if defined $isa;
+   print  STDERR "\n";
+
+   printf STDERR "  %6s %7s %7s", 'worker', 'chunks', 'blocks';
+   printf STDERR " %7s", $_ for @cols;
+   print  STDERR "\n";
+
+   for $row (sort { $a->{wid} <=> $b->{wid} } @stats_rows) {
+      if (defined $row->{t_last}) {
+         $row->{idle} = $row->{t_last} - $row->{t_begin} - $row->{busy};
+         $row->{tail} = $t_end - $row->{t_last};
+      }
+
+      printf STDERR "  %6d %7d %7d", @{ $row }{qw( wid chunks blocks )};
+      printf STDERR " %7.03f", $row->{$_} // 0 for @cols;
+      print  STDERR "\n";
+
+      $total{$_} += $row->{$_} // 0 for ('chunks', 'blocks', @cols);
+   }
+
+   if (@stats_rows > 1) {
+      printf STDERR "  %6s %7d %7d", 'total', @total{qw( chunks blocks )};
+      printf STDERR " %7.03f", $total{$_} for @cols;
+      print  STDERR "\n";
+   }
+
+   return;
+}
+
 ###############################################################################
 ## ----------------------------------------------------------------------------
 ## The end.
@@ -10,13 +10,346 @@
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
+#include <errno.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
 
 #include "sandbox.h"
+#include "numa.h"
 
 const  int64_t  QP_LIMIT = 1054092553;   // sqrt(1e19)/3
 
-static uint64_t FROM_val, FROM_adj, N_val;
-static byte_t   *is_prime, *pre_sieve17;
+static uint64_t FROM_val, FROM_adj, N_val, SIEVE_sz;
+static int64_t  L1D_sz;
+static byte_t   *is_prime, *pre_sieve17, *pre_sieve23;
+static byte_t   *is_prime_map, *pre_sieve30;
+static size_t   is_prime_map_sz;
+
+// The sieving primes from 29 (i = 9) through SP_max, as deltas between
+// successive indices. Index gaps below sqrt(1e19) are under 128, so a
+// byte per prime suffices. Workers walk this list instead of testing
+// every index against is_prime.
+
+static byte_t   *sp_delta;
+static size_t   sp_delta_sz;
+static int64_t  SP_cnt, SP_max;
+static int      wheel = 6;
+
+// Copies of the tables read by workers while sieving, one per NUMA node.
+// The first worker pinned to a node fills its copy, so the pages are local
+// to that node. The state is 0 (empty), 1 (filling), or 2 (ready).
+
+typedef struct {
+   int    state;
+   byte_t *pre17, *pre23, *delta;
+} replica_t;
+
+static replica_t *replicas;
+static size_t   pre_sieve17_sz, replica_sz;
+static int      n_nodes = 1;
+
+// Results of count and sum mode kept in memory shared with the manager,
+// one slot per worker, instead of gathering each chunk. A slot fills a
+// cache line, so workers never write to the same line. The worker adds
+// each chunk's result and length, and notes where the chunk ended.
+
+typedef struct {
+   sum_t    agg;
+   uint64_t done, next, chunks;
+   byte_t   pad[64 - sizeof(sum_t) - 24];
+} slot_t;
+
+static slot_t   *slots;
+static int      n_slots;
+static THREAD_LOCAL slot_t *slot;
+
+// Sieving primes whose stride fits inside a block. These hit every
+// block, so their next offset is carried forward between blocks.
+
+typedef struct {
+   uint64_t j;
+   uint32_t ij, t;
+} sprime_t;
+
+// Larger sieving primes hit a block at most a few times, if at all.
+// Each is kept in the bucket of the block containing its next multiple
+// (Oliveira e Silva), so a block only visits the primes landing in it.
+// An entry holds the bit position inside that block and the index i
+// of the prime, with the high bit set if the next stride is t - ij.
+
+#define BUCKET_SZ 1023
+
+typedef struct {
+   uint32_t pos, i;
+} bprime_t;
+
+typedef struct bucket {
+   struct bucket *next;
+   uint32_t n;
+   bprime_t e[BUCKET_SZ];
+} bucket_t;
+
+// At the end of a chunk, every sieving prime up to the chunk's q is one
+// stride or less past it: the small primes in sp, and the large primes
+// dropped from the buckets, kept in a carry list with pos relative to the
+// last index of the chunk. A thread handed the chunk that follows resumes
+// from there instead of dividing to find each prime's first multiple.
+// The list holds at most SP_cnt entries, kept if within CARRY_MAX_SZ.
+
+#define CARRY_MAX_SZ (64 * 1024 * 1024)
+
+typedef struct {
+   uint64_t next;
+   int64_t  gen, n_small, n_list, i_small, i_list, n_carry;
+} carry_t;
+
+static int64_t sieve_gen = 0;
+
+// Number of primes collected before calling write_output_batch.
+
+#define PRINT_BATCH 2048
+
+// Run mode of wheel_chunk for practicalsieve_fill, storing primes in the
+// caller's buffer (fill_t) until full. The next prime not stored, else the
+// number after the chunk, is left in next.
+
+#define MODE_FILL 4
+
+typedef struct {
+   uint64_t *dst, next;
+   int64_t  n, cap;
+} fill_t;
+
+// Pre-sieve pattern for 19 and 23, which repeats every 2 * 19 * 23 bits
+// of the sieve (6 * 19 * 23 numbers), therefore every 874 bytes. One copy
+// (twice the period long) per bit shift, so a block is ANDed byte-wise at
+// any starting index.
+
+#define PS23_BITS 874
+#define PS23_LEN  (2 * PS23_BITS)
+
+// The mod-30 wheel engine (set_wheel). A byte holds the numbers coprime
+// to 30 in [30k, 30k + 29], one bit per residue 1, 7, 11, ..., 29, which is
+// 8 bits per 30 numbers instead of 10. The pre-sieve pattern for 7, 11, 13,
+// and 17 repeats every 7 * 11 * 13 * 17 bytes; twice the period is kept,
+// so a piece of up to one period is copied from any starting byte.
+
+#define PS30_LEN  17017
+
+// A sieving prime p = 30a + r for the wheel: the next multiple p * m is at
+// byte off, and m is congruent to residue wi. Bucket entries hold wi in the
+// high bits of pos, above the byte offset inside the block.
+
+#define WPOS_BITS 29
+
+typedef struct {
+   uint64_t off;
+   uint32_t a;
+   uint16_t ri, wi;
+} wprime_t;
+
+// Inner loops of both engines, one kernel per task: crossing off the
+// small primes, summing the primes of a block, or listing them into a
+// buffer. Each is compiled for several ISA levels, chosen once by
+// kernels_init (see "Kernels" below).
+
+typedef struct {
+   void    (*cross6)(byte_t *, sprime_t *, int64_t, int64_t, uint64_t,
+                     uint64_t);
+   sum_t   (*sum6)(const byte_t *, int64_t, uint64_t, uint64_t *);
+   int64_t (*list6)(const byte_t *, int64_t, uint64_t, int64_t *,
+                    uint64_t *, uint64_t *, int64_t);
+   void    (*cross30)(byte_t *, wprime_t *, int64_t, int64_t, uint64_t,
+                      uint64_t);
+   sum_t   (*sum30)(const byte_t *, int64_t, uint64_t, uint64_t *);
+   int64_t (*list30)(const byte_t *, int64_t, uint64_t, int64_t *,
+                     uint64_t *, uint64_t *, int64_t);
+   const char *isa;
+} kernels_t;
+
+static kernels_t kern;
+
+static void kernels_init(void);
+
+// The is_prime cache file is this header followed by the bitmap. The
+// checksum is over the bitmap, 8 bytes at a time (FNV-1a).
+
+#define CACHE_MAGIC   "A3ISPRIM"
+#define CACHE_VERSION 1
+
+// Why cache_load returned NULL. Only a missing or stale cache is replaced;
+// a file not starting with CACHE_MAGIC is never written over.
+
+enum { CACHE_OK, CACHE_MISSING, CACHE_STALE, CACHE_FOREIGN };
+
+typedef struct {
+   char     magic[8];
+   uint32_t version, hdr_sz;
+   uint64_t q, mem_sz, checksum;
+   byte_t   reserved[24];
+} cache_hdr_t;
+
+// The index file (--index) is this header followed by an entry per stride:
+// the count and the sum of primes through k * stride, for k = 1 through n.
+
+#define INDEX_MAGIC   "A3PINDEX"
+#define INDEX_VERSION 1
+
+typedef struct {
+   char     magic[8];
+   uint32_t version, hdr_sz;
+   uint64_t stride, n_entries, sum_bits;
+   byte_t   reserved[24];
+} index_hdr_t;
+
+typedef struct {
+   uint64_t count, sum_lo, sum_hi;
+} index_entry_t;
+
+//#############################################################################
+// ----------------------------------------------------------------------------
+// Cache functions for is_prime. A cache holding at least q bits is mapped
+// read-only, so startup skips the sieve and workers share the same pages.
+//
+//#############################################################################
+
+static uint64_t cache_checksum(const byte_t *data, uint64_t mem_sz)
+{
+   uint64_t h = 0xcbf29ce484222325ULL, n;
+
+   for (n = 0; n + 8 <= mem_sz; n += 8)
+      h = (h ^ load_word(data + n)) * 0x100000001b3ULL;
+   for (; n < mem_sz; n++)
+      h = (h ^ data[n]) * 0x100000001b3ULL;
+
+   return h;
+}
+
+// Returns the type of file at path: missing, a cache, or something else.
+
+static int cache_probe(const char *path)
+{
+#if !defined(_WIN32)
+   char magic[8];
+   int fd, ours;
+
+   if ((fd = open(path, O_RDONLY)) < 0)
+      return (errno == ENOENT) ? CACHE_MISSING : CACHE_FOREIGN;
+
+   ours = pread(fd, magic, 8, 0) == 8 && !memcmp(magic, CACHE_MAGIC, 8);
+   close(fd);
+
+   return ours ? CACHE_STALE : CACHE_FOREIGN;
+#else
+   return CACHE_FOREIGN;
+#endif
+}
+
+static byte_t *cache_load(const char *path, int64_t q, int *why)
+{
+#if !defined(_WIN32)
+   cache_hdr_t hdr;
+   struct stat st;
+   byte_t *map;
+   int fd;
+
+   if ((*why = cache_probe(path)) != CACHE_STALE)
+      return NULL;
+
+   if ((fd = open(path, O_RDONLY)) < 0) {
+      *why = CACHE_FOREIGN;
+      return NULL;
+   }
+
+   if (fstat(fd, &st) || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+         hdr.version != CACHE_VERSION ||
+         hdr.hdr_sz != sizeof(hdr) || hdr.q < (uint64_t) q ||
+         hdr.mem_sz != (hdr.q + 2 + 7) / 8 ||
+         (uint64_t) st.st_size != hdr.hdr_sz + hdr.mem_sz) {
+      close(fd);
+      return NULL;
+   }
+
+   map = (byte_t *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+
+   if (map == (byte_t *) MAP_FAILED)
+      return NULL;
+
+   if (cache_checksum(map + hdr.hdr_sz, hdr.mem_sz) != hdr.checksum) {
+      fprintf(stderr, "warning: ignoring corrupt cache file %s\n", path);
+      munmap((void *) map, st.st_size);
+      return NULL;
+   }
+
+   is_prime_map = map, is_prime_map_sz = st.st_size;
+   *why = CACHE_OK;
+
+   return map + hdr.hdr_sz;
+#else
+   *why = CACHE_FOREIGN;
+   return NULL;
+#endif
+}
+
+// Write the cache to a temporary file first, then rename it into place.
+// Failure is not fatal; the cache is optional. Only a missing file or an
+// older cache is replaced, so a mistyped path cannot clobber other data.
+
+static void cache_save(const char *path, const byte_t *data, int64_t q)
+{
+#if !defined(_WIN32)
+   cache_hdr_t hdr;
+   uint64_t off;
+   ssize_t  n;
+   char     *tmp;
+   int      fd, ok = 0;
+
+   if (cache_probe(path) == CACHE_FOREIGN) {
+      fprintf(stderr, "warning: could not write cache file %s\n", path);
+      return;
+   }
+
+   memset(&hdr, 0, sizeof(hdr));
+   memcpy(hdr.magic, CACHE_MAGIC, 8);
+
+   hdr.version = CACHE_VERSION, hdr.hdr_sz = sizeof(hdr);
+   hdr.q = q, hdr.mem_sz = (q + 2 + 7) / 8;
+   hdr.checksum = cache_checksum(data, hdr.mem_sz);
+
+   tmp = (char *) malloc(strlen(path) + 24);
+   sprintf(tmp, "%s.%d", path, (int) getpid());
+
+   if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+      if (write(fd, &hdr, sizeof(hdr)) == sizeof(hdr)) {
+         for (off = 0; off < hdr.mem_sz; off += n)
+            if ((n = write(fd, data + off, hdr.mem_sz - off)) <= 0)
+               break;
+
+         ok = (off == hdr.mem_sz);
+      }
+
+      if (close(fd)) ok = 0;
+      if (ok && rename(tmp, path)) ok = 0;
+      if (!ok) unlink(tmp);
+   }
+
+   if (!ok)
+      fprintf(stderr, "warning: could not write cache file %s\n", path);
+
+   free((void *) tmp);
+#endif
+}
 
 //#############################################################################
 // ----------------------------------------------------------------------------
@@ -24,11 +357,216 @@ static byte_t   *is_prime, *pre_sieve17;
 //
 //#############################################################################
 
+// Allocate memory shared with forked workers, rather than copy-on-write.
+// Sets *mapped to 0 if it fell back to malloc.
+
+static void *shared_alloc(size_t size, int *mapped)
+{
+#if !defined(_WIN32)
+   void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+   if (ptr != MAP_FAILED) {
+      *mapped = 1;
+      return ptr;
+   }
+#endif
+
+   *mapped = 0;
+
+   return malloc(size);
+}
+
+// The is_prime array is sieved in segments of PRECALC_SEG bits, a multiple
+// of 512 so that threads never share a cache line. Segments are handed
+// out round-robin to the threads.
+
+#define PRECALC_SEG 524288
+
+typedef struct {
+   byte_t   *bits;
+   sprime_t *base;
+   int64_t  n_base, r, q, n_segs;
+   int      id, n_threads;
+} precalc_arg_t;
+
+static void *precalc_segments(void *arg)
+{
+   precalc_arg_t *a = (precalc_arg_t *) arg;
+   uint64_t j, ij, t, lo, hi;
+   int64_t  s, n;
+
+   for (s = a->id; s < a->n_segs; s += a->n_threads) {
+      lo = s * PRECALC_SEG, hi = lo + PRECALC_SEG - 1;
+
+      if (lo <= (uint64_t) a->r) lo = a->r + 1;
+      if (hi >  (uint64_t) a->q) hi = a->q;
+
+      for (n = 0; n < a->n_base; n++) {
+         j = a->base[n].j, ij = a->base[n].ij, t = a->base[n].t;
+
+         // The base primes are in order, so are their squares.
+         if (j > hi)
+            break;
+
+         // Skip numbers before this segment.
+         if (j < lo) {
+            j += (lo - 1 - j) / t * t + ij, ij = t - ij;
+            if (j < lo)
+               j += ij, ij = t - ij;
+         }
+
+         // Clear composites.
+         while (j <= hi) {
+            CLEARBIT(a->bits, j);
+            j += ij, ij = t - ij;
+         }
+      }
+   }
+
+   return NULL;
+}
+
+// Compute is_prime up to q. The base primes, those whose square is <= q,
+// are sieved serially. The rest is divided among n_threads native threads.
+// The bitmap lives in a shared anonymous mapping, so forked workers
+// reference the same pages rather than copy-on-write copies.
+
+static byte_t *compute_is_prime(int64_t q, int n_threads)
+{
+   precalc_arg_t *args;
+   uint64_t c, k, t, j, ij;
+   int64_t  i, r, mem_sz, n_base;
+   sprime_t *base;
+   byte_t   *bits;
+   int      mapped;
+
+   mem_sz = (q + 2 + 7) / 8;
+
+   bits = (byte_t *) shared_alloc(mem_sz, &mapped);
+
+   if (mapped)
+      is_prime_map = bits, is_prime_map_sz = mem_sz;
+
+   memset(bits, 0xff, mem_sz);
+
+   // Find r, the last index whose square (c) is <= q.
+   c = 0, k = 1, t = 2, r = 0;
+
+   for (i = 1; ; i++) {
+      k = 3 - k, c = 4 * k * i + c;
+      if (c > (uint64_t) q) break;
+      r = i;
+   }
+
+   // Clear small composites <= r, collecting the base primes.
+   base = (sprime_t *) malloc(sizeof(sprime_t) * (r + 1));
+   c = 0, k = 1, t = 2, n_base = 0;
+
+   for (i = 1; i <= r; i++) {
+      k  = 3 - k, c = 4 * k * i + c, j = c;
+      ij = 2 * i * (3 - k) + 1, t = 4 * k + t;
+
+      if (ISBITSET(bits, i)) {
+         base[n_base].j = j, base[n_base].ij = ij, base[n_base].t = t;
+         n_base++;
+
+         while (j <= (uint64_t) r) {
+            CLEARBIT(bits, j);
+            j += ij, ij = t - ij;
+         }
+      }
+   }
+
+   // Clear composites in (r, q].
+   if (n_threads > q / PRECALC_SEG + 1) n_threads = q / PRECALC_SEG + 1;
+   if (n_threads < 1) n_threads = 1;
+
+   args = (precalc_arg_t *) malloc(sizeof(precalc_arg_t) * n_threads);
+
+   for (i = 0; i < n_threads; i++) {
+      args[i].bits = bits, args[i].base = base, args[i].n_base = n_base;
+      args[i].r = r, args[i].q = q, args[i].n_segs = q / PRECALC_SEG + 1;
+      args[i].id = i, args[i].n_threads = n_threads;
+   }
+
+#if !defined(_WIN32)
+   if (n_threads > 1) {
+      pthread_t *tids = (pthread_t *) malloc(sizeof(pthread_t) * n_threads);
+      int64_t  n_started;
+
+      for (i = 1; i < n_threads; i++)
+         if (pthread_create(&tids[i], NULL, precalc_segments, &args[i]))
+            break;
+
+      // Clearing is idempotent. If a thread failed to start, this thread
+      // takes all segments, overlapping the threads already running.
+      if ((n_started = i) < n_threads)
+         args[0].n_threads = 1;
+
+      precalc_segments(&args[0]);
+
+      for (i = 1; i < n_started; i++)
+         pthread_join(tids[i], NULL);
+
+      free((void *) tids);
+   }
+   else
+#endif
+   {
+      args[0].n_threads = 1;
+      precalc_segments(&args[0]);
+   }
+
+   free((void *) args);
+   free((void *) base);
+
+   return bits;
+}
+
+// Extract the sieving-prime list from is_prime, for indices 9 through q.
+
+static void build_sieving_list(int64_t q)
+{
+   uint64_t bits, prev;
+   int64_t  i, off, mem_sz;
+   byte_t   tail[8];
+   int      mapped;
+
+   mem_sz = (q + 1 + 7) / 8;
+   sp_delta_sz = popcount(is_prime, mem_sz) + 1;
+   sp_delta = (byte_t *) shared_alloc(sp_delta_sz, &mapped);
+
+   if (!mapped)
+      sp_delta_sz = 0;
+
+   SP_cnt = 0, SP_max = q, prev = 0;
+
+   for (off = 0; off < mem_sz; off += 8) {
+      if (off + 8 <= mem_sz) {
+         bits = load_word(is_prime + off);
+      }
+      else {
+         memset(tail, 0, 8), memcpy(tail, is_prime + off, mem_sz - off);
+         bits = load_word(tail);
+      }
+
+      while (bits) {
+         i = off * 8 + CTZ64(bits), bits &= bits - 1;
+
+         if (i >= 9 && i <= q)
+            sp_delta[SP_cnt++] = (byte_t) (i - prev), prev = i;
+      }
+   }
+}
+
 void practicalsieve_precalc(
-      SV *from_adj_sv, SV *from_val_sv, SV *n_val_sv, SV *sieve_sz_sv )
+      SV *from_adj_sv, SV *from_val_sv, SV *n_val_sv, SV *sieve_sz_sv,
+      int l1d_sz, char *cache_file, int n_threads )
 {
    uint64_t j_off, c, k, t, j, ij, sieve_sz;
    int64_t  c_off, i, q, mem_sz;
+   int      why = CACHE_MISSING;
 
    #ifdef __LP64__
       FROM_adj = SvUV(from_adj_sv);
@@ -48,32 +586,38 @@ void practicalsieve_precalc(
       exit(2);
    }
 
+   SIEVE_sz = sieve_sz;
+
+   // Choose the kernels for this cpu, before any worker starts.
+   kernels_init();
+
+   // Sieve the smallest primes in L1 sized pieces of the block.
+   L1D_sz = (l1d_sz < 4096) ? 4096 : l1d_sz & ~7;
+
    //====================================================================
    // Compute is_prime. This enables workers to process faster.
+   // Map it from the cache file instead, if given and large enough.
    //====================================================================
 
    q = (int64_t) sqrt((double) N_val) / 3;
-   c = 0, k = 1, t = 2;
 
    if (q > QP_LIMIT) q = QP_LIMIT;
 
-   mem_sz = (q + 2 + 7) / 8;
-   is_prime = (byte_t *) malloc(mem_sz);
-   memset(is_prime, 0xff, mem_sz);
-
-   // Clear small composites <= q. Workers to clear <= M.
-   for (i = 1; i <= q; i++) {
-      k  = 3 - k, c = 4 * k * i + c, j = c;
-      ij = 2 * i * (3 - k) + 1, t = 4 * k + t;
+   if (!*cache_file || (is_prime = cache_load(cache_file, q, &why)) == NULL) {
+      is_prime = compute_is_prime(q, n_threads);
 
-      if (ISBITSET(is_prime, i)) {
-         while (j <= q) {
-            CLEARBIT(is_prime, j);
-            j += ij, ij = t - ij;
-         }
-      }
+      if (*cache_file && why == CACHE_FOREIGN)
+         fprintf(stderr, "warning: %s is not a cache file, leaving it alone\n",
+            cache_file);
+      else if (*cache_file)
+         cache_save(cache_file, is_prime, q);
    }
 
+   build_sieving_list(q);
+
+   // Offsets carried by a thread are for the tables of this call only.
+   sieve_gen++;
+
    //====================================================================
    // Pre-sieve 5, 7, 11, 13, and 17 (i = 1 through 5).
    //====================================================================
@@ -81,6 +625,7 @@ void practicalsieve_precalc(
    sieve_sz /= 3, mem_sz = (sieve_sz + 2 + 7) / 8;
 
    pre_sieve17 = (byte_t *) malloc(mem_sz);
+   pre_sieve17_sz = mem_sz;
    memset(pre_sieve17, 0xff, mem_sz);
    CLEARBIT(pre_sieve17, 0);
 
@@ -109,7 +654,6 @@ void practicalsieve_precalc(
    }
 
    //====================================================================
-   // At this point, i = 6, c = 96, k = 2, and t = 34.
    // Workers will not need to process i = 1 through 5.
    //
    // Clear bits for 5,7,11,13,17 including bit 0.
@@ -118,202 +662,2538 @@ void practicalsieve_precalc(
 
    if (FROM_adj == 1)
       pre_sieve17[0] = 0xc0;
-}
-
-void practicalsieve_memfree()
-{
-   free((void *) pre_sieve17);
-   pre_sieve17 = NULL;
 
-   free((void *) is_prime);
-   is_prime = NULL;
+   //====================================================================
+   // Pre-sieve 19 and 23 (i = 6 and 7). Workers begin with 29 (i = 9).
+   //====================================================================
 
-   fflush(stdout);
-}
+   pre_sieve23 = (byte_t *) malloc(8 * PS23_LEN);
 
-//#############################################################################
-// ----------------------------------------------------------------------------
-// Parallel sieve based off serial code from Xuedong Luo (Algorithm3).
-//
-// <> A practical sieve algorithm for finding prime numbers.
-//    ACM Volume 32 Issue 3, March 1989, Pages 344-346
-//    http://dl.acm.org/citation.cfm?doid=62065.62072
-//
-//#############################################################################
+   for (i = 0; i < 8 * PS23_LEN; i++) {
+      pre_sieve23[i] = 0xff;
 
-SV* practicalsieve(SV *start_sv, SV *limit_sv, int run_mode, int fd)
-{
-   AV       *ret;
-   uint64_t n_ret, start, limit, j_off, n_off, M1, c, k, t, j, ij;
-   int64_t  q, M2, i, mem_sz;
-   byte_t   *sieve;
-   int      err, flag;
+      for (k = 0; k < 8; k++) {
+         // Bit k of byte m for shift s is index 8m + s + k.
+         j = (8 * (i % PS23_LEN) + i / PS23_LEN + k) % PS23_BITS;
+         c = 3 * j + 1 + (j & 1);
 
-   #ifdef __LP64__
-      start = SvUV(start_sv);
-      limit = SvUV(limit_sv);
-   #else
-      start = strtoull(SvPV_nolen(start_sv), NULL, 10);
-      limit = strtoull(SvPV_nolen(limit_sv), NULL, 10);
-   #endif
+         if (c % 19 == 0 || c % 23 == 0)
+            pre_sieve23[i] &= unset_bit[k];
+      }
+   }
+}
 
-   ret = newAV(), n_ret = 0, err = 0;
+// Set up one replica per NUMA node, mapped before the workers are spawned
+// and left untouched until a worker binds to the node. Returns the number
+// of nodes. On a single node, workers are only pinned.
 
-   //====================================================================
-   // Sieve algorithm.
-   //====================================================================
+int practicalsieve_numa_init()
+{
+   byte_t *mem;
+   int    i, mapped;
 
-   M1 = limit / 3, c = 96, k = 2, t = 34, q = sqrt(limit) / 3;
-   M2 = (limit + (limit & 1) - start) / 3;
-   n_off = start - 1, j_off = n_off / 3;
-   mem_sz = (M2 + 2 + 7) / 8;
+   n_nodes = numa_node_count();
 
-   sieve = (byte_t *) malloc(mem_sz);
+   if (n_nodes < 2 || replicas != NULL)
+      return n_nodes;
 
-   // Copy pre-sieved data into sieve.
-   memcpy(sieve, pre_sieve17, mem_sz);
+   replicas = (replica_t *) shared_alloc(sizeof(replica_t) * n_nodes, &mapped);
 
-   // Fix byte 0 if starting at 1 (has primes 5,7,11,13,17).
-   if (start == 1) sieve[0] = 0xfe;
+   if (!mapped) {
+      free((void *) replicas);
+      replicas = NULL;
+      return n_nodes;
+   }
 
-   // Unset bits > limit.
-   i = mem_sz * 8 - (M2 + 2);
+   replica_sz = pre_sieve17_sz + 8 * PS23_LEN + SP_cnt + 1;
 
-   while (i) {
-      CLEARBIT(sieve, (mem_sz - 1) * 8 + (8 - i));
-      i--;
-   }
+   for (i = 0; i < n_nodes; i++) {
+      mem = (byte_t *) shared_alloc(replica_sz, &mapped);
 
-   // Clear composites < FROM_val.
-   if (start == FROM_adj) {
-      for (i = 1; i <= 3; i++) {
-         if (n_off + (3 * i + 1 | 1) >= FROM_val)
-            break;
-         CLEARBIT(sieve, i);
+      if (!mapped) {
+         // Workers on this node keep using the manager's tables.
+         free((void *) mem);
+         replicas[i].state = -1, replicas[i].pre17 = NULL;
+         continue;
       }
-   }
 
-   // Clear composites > N_val.
-   if (limit == N_val) {
-      if (n_off + (3 * (M2 + 1) + 1) > N_val + (N_val & 1))
-         CLEARBIT(sieve, M2 + 1);
-      if (n_off + (3 * M2 + 2) > N_val + (N_val & 1))
-         CLEARBIT(sieve, M2);
+      replicas[i].state = 0;
+      replicas[i].pre17 = mem;
+      replicas[i].pre23 = mem + pre_sieve17_sz;
+      replicas[i].delta = mem + pre_sieve17_sz + 8 * PS23_LEN;
    }
 
-   // Process this block. Sieving begins with 19 (i = 6).
-   for (i = 6; i <= q; i++) {
-      k  = 3 - k, c = 4 * k * i + c, j = c;
-      ij = 2 * i * (3 - k) + 1, t = 4 * k + t;
-
-      // The is_prime array enables workers to bypass block many times.
-      if ((flag = (i > QP_LIMIT)) || ISBITSET(is_prime, i)) {
+   return n_nodes;
+}
 
-         // Skip multiples of 5.
-         if (flag && (3 * i + k) % 5 == 0)
-            continue;
+// Pin worker id (1 based) to a core, spreading ids round-robin across
+// nodes. With replicate, switch to the node's copy of the tables; only
+// for workers with their own address space (processes, not threads).
+// Returns the cpu, or -1 if pinning failed.
 
-         // Skip numbers before this block.
-         if (j < j_off) {
-            j += (j_off - j) / t * t + ij, ij = t - ij;
-            if (j < j_off)
-               j += ij, ij = t - ij;
-         }
+int practicalsieve_numa_bind(int id, int replicate)
+{
+   replica_t *r;
+   int node, cpu, state;
 
-         // Clear composites.
-         while (j <= M1) {
-            CLEARBIT(sieve, j - j_off);
-            j += ij, ij = t - ij;
-         }
-      }
-   }
+   node = (id - 1) % n_nodes;
+   cpu  = numa_pin(node, (id - 1) / n_nodes);
 
-   //====================================================================
-   // Count primes, sum primes, otherwise output primes for this block.
-   //====================================================================
+   if (!replicate || replicas == NULL || cpu < 0)
+      return cpu;
 
-   if (run_mode == MODE_COUNT) {
-      if (2 >= start && 2 >= FROM_val && 2 <= N_val)
-         n_ret++;
-      if (3 >= start && 3 >= FROM_val && 3 <= N_val)
-         n_ret++;
+   r = &replicas[node];
+   state = 0;
 
-      n_ret += popcount(sieve, mem_sz);
+#if !defined(_WIN32)
+   if (__atomic_compare_exchange_n(&r->state, &state, 1, 0,
+         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      memcpy(r->pre17, pre_sieve17, pre_sieve17_sz);
+      memcpy(r->pre23, pre_sieve23, 8 * PS23_LEN);
+      memcpy(r->delta, sp_delta, SP_cnt + 1);
+      __atomic_store_n(&r->state, 2, __ATOMIC_RELEASE);
    }
-   else if (run_mode == MODE_SUM) {
-      if (2 >= start && 2 >= FROM_val && 2 <= N_val)
-         n_ret += 2;
-      if (3 >= start && 3 >= FROM_val && 3 <= N_val)
-         n_ret += 3;
-
-      for (i = 1; i <= M2; i += 2) {
-         if (ISBITSET(sieve, i))
-            n_ret += n_off + (3 * i + 2);
-         if (ISBITSET(sieve, i + 1))
-            n_ret += n_off + (3 * (i + 1) + 1);
-      }
+   else if (state == -1) {
+      return cpu;
    }
-   else {
-      char *buf; int len;
-
-      buf = (char *) malloc(FLUSH_LIMIT + 216);
-      len = 0;
-
-      // Think of an imaginary list containing sequence of numbers.
-      // The n_off value is used to determine the starting offset.
-      //
-      // Avoid all composites that have 2 or 3 as one of their prime
-      // factors (where i is odd).
-      //
-      // { 0, 5, 7, 11, 13, ... 3i + 2, 3(i + 1) + 1, ..., N }
-      //   0, 1, 2,  3,  4, ... list indices (0 is not used)
-
-      if (2 >= start && 2 >= FROM_val && 2 <= N_val)
-         write_output(fd, buf, 2, &len);
-      if (3 >= start && 3 >= FROM_val && 3 <= N_val)
-         write_output(fd, buf, 3, &len);
-
-      for (i = 1; i <= M2; i += 2) {
-         if (ISBITSET(sieve, i))
-            if ((err = write_output(fd, buf, n_off + (3*i+2), &len)))
-               break;
-         if (ISBITSET(sieve, i + 1))
-            if ((err = write_output(fd, buf, n_off + (3*(i+1)+1), &len)))
-               break;
-      }
-
-      if (!err)
-         err = flush_output(fd, buf, &len);
 
-      free((void *) buf);
-      buf = NULL;
-   }
+   while (__atomic_load_n(&r->state, __ATOMIC_ACQUIRE) != 2)
+      usleep(100);
 
-   free((void *) sieve);
-   sieve = NULL;
+   pre_sieve17 = r->pre17, pre_sieve23 = r->pre23, sp_delta = r->delta;
+#endif
 
-   //====================================================================
-   // Return.
-   //====================================================================
+   return cpu;
+}
 
-   if (run_mode == MODE_PRINT) {
-      av_push(ret, newSViv(err));
+void practicalsieve_memfree()
+{
+   int i;
+
+   free((void *) pre_sieve17);
+   pre_sieve17 = NULL;
+
+   free((void *) pre_sieve23);
+   pre_sieve23 = NULL;
+
+   free((void *) pre_sieve30);
+   pre_sieve30 = NULL;
+
+   if (is_prime_map != NULL) {
+   #if !defined(_WIN32)
+      munmap((void *) is_prime_map, is_prime_map_sz);
+   #endif
+      is_prime_map = NULL, is_prime_map_sz = 0;
    }
    else {
-      #ifdef __LP64__
-         av_push(ret, newSVuv(n_ret));
+      free((void *) is_prime);
+   }
 
-      #else
-         SV *n_sv; char *ptr; STRLEN len; int n_chars;
+   is_prime = NULL;
+
+   if (sp_delta_sz != 0) {
+   #if !defined(_WIN32)
+      munmap((void *) sp_delta, sp_delta_sz);
+   #endif
+   }
+   else {
+      free((void *) sp_delta);
+   }
+
+   sp_delta = NULL, sp_delta_sz = 0;
+
+   if (replicas != NULL) {
+   #if !defined(_WIN32)
+      for (i = 0; i < n_nodes; i++) {
+         if (replicas[i].pre17 != NULL)
+            munmap((void *) replicas[i].pre17, replica_sz);
+      }
+      munmap((void *) replicas, sizeof(replica_t) * n_nodes);
+   #endif
+      replicas = NULL;
+   }
+
+   if (slots != NULL) {
+   #if !defined(_WIN32)
+      munmap((void *) slots, sizeof(slot_t) * n_slots);
+   #endif
+      slots = NULL, n_slots = 0;
+   }
+
+   fflush(stdout);
+}
+
+// Number of bits for sums of primes; 64 limits N to 29505444490.
+
+int sum_bits()
+{
+   return SUM_BITS;
+}
+
+// Select the print format: FORMAT_TEXT, FORMAT_UINT64, or FORMAT_DELTA.
+
+void set_output_format(int fmt)
+{
+   output_fmt = fmt;
+}
+
+// Memory-backed output, see output.h.
+
+int output_open()
+{
+   return mem_output_open();
+}
+
+SV* output_size(int fd)
+{
+   return newSViv((IV) mem_output_size(fd));
+}
+
+SV* output_send(int in_fd, int out_fd)
+{
+   return newSViv((IV) mem_output_send(in_fd, out_fd));
+}
+
+SV* output_pwrite(int in_fd, int out_fd, SV *offset_sv)
+{
+   int64_t offset;
+
+   #ifdef __LP64__
+      offset = SvIV(offset_sv);
+   #else
+      offset = strtoll(SvPV_nolen(offset_sv), NULL, 10);
+   #endif
+
+   return newSViv((IV) mem_output_pwrite(in_fd, out_fd, offset));
+}
+
+void output_close(int fd)
+{
+   mem_output_close(fd);
+}
+
+//#############################################################################
+// ----------------------------------------------------------------------------
+// Parallel sieve based off serial code from Xuedong Luo (Algorithm3).
+//
+// <> A practical sieve algorithm for finding prime numbers.
+//    ACM Volume 32 Issue 3, March 1989, Pages 344-346
+//    http://dl.acm.org/citation.cfm?doid=62065.62072
+//
+//#############################################################################
+
+static void bucket_push(
+      bucket_t **heads, bucket_t **pool, int64_t b, uint32_t pos, uint32_t i )
+{
+   bucket_t *bk = heads[b];
+
+   if (bk == NULL || bk->n == BUCKET_SZ) {
+      if ((bk = *pool) != NULL)
+         *pool = bk->next;
+      else
+         bk = (bucket_t *) malloc(sizeof(bucket_t));
+
+      bk->next = heads[b], bk->n = 0;
+      heads[b] = bk;
+   }
+
+   bk->e[bk->n].pos = pos, bk->e[bk->n].i = i;
+   bk->n++;
+}
+
+// Push a large sieving prime into the bucket of the block holding its
+// first multiple inside the chunk, if any. The prime's square is at j.
+// Otherwise, append it to the carry list unless cl is NULL.
+
+static void bucket_first(
+      bucket_t **heads, bucket_t **pool, int64_t i, uint64_t j, uint64_t ij,
+      uint64_t t, uint64_t j_beg, uint64_t M1_end, uint64_t W,
+      bprime_t *cl, int64_t *n_cl )
+{
+   uint64_t ij0 = ij;
+   int64_t  b;
+
+   // Skip numbers before this chunk, including bit 0.
+   if (j <= j_beg) {
+      j += (j_beg - j) / t * t + ij, ij = t - ij;
+      if (j <= j_beg)
+         j += ij, ij = t - ij;
+   }
+
+   if (j <= M1_end) {
+      b = (j - j_beg - 1) / W;
+      bucket_push(heads, pool, b, j - j_beg - b * W,
+         (uint32_t) i | (uint32_t) (ij != ij0) << 31);
+   }
+   else if (cl != NULL) {
+      cl[*n_cl].pos = j - M1_end;
+      cl[*n_cl].i = (uint32_t) i | (uint32_t) (ij != ij0) << 31;
+      (*n_cl)++;
+   }
+}
+
+// AND the pre-sieve pattern for 19 and 23 into len bytes of the sieve,
+// whose first bit is index g.
+
+static void pre_sieve_and(byte_t *dst, uint64_t g, int64_t len)
+{
+   const byte_t *pat;
+   int64_t m, n, x;
+
+   g %= PS23_BITS;
+   pat = pre_sieve23 + (g & 7) * PS23_LEN, m = g >> 3;
+
+   for (; len > 0; dst += n, len -= n) {
+      n = (len < PS23_BITS) ? len : PS23_BITS;
+
+      // Advancing 874 bytes returns to the same pattern offset.
+      for (x = 0; x < n; x++)
+         dst[x] &= pat[m + x];
+   }
+}
+
+static void bucket_free(bucket_t *bk)
+{
+   bucket_t *next;
+
+   while (bk != NULL) {
+      next = bk->next;
+      free((void *) bk);
+      bk = next;
+   }
+}
+
+// Empty buckets are kept per thread between chunks, until released.
+
+static THREAD_LOCAL bucket_t *bucket_spare;
+static THREAD_LOCAL carry_t  carry;
+
+static void bucket_recycle(bucket_t *bk, bucket_t **pool)
+{
+   bucket_t *next;
+
+   while (bk != NULL) {
+      next = bk->next, bk->next = *pool, *pool = bk;
+      bk = next;
+   }
+}
+
+// Release the calling thread's buffers, kept since its first chunk.
+// Each worker calls this when done, before practicalsieve_memfree().
+
+void practicalsieve_release()
+{
+   arena_release();
+
+   bucket_free(bucket_spare);
+   bucket_spare = NULL, carry.next = 0;
+}
 
-         n_sv = newSVpvn("", N_MAXDIGITS);
-         ptr = SvPV(n_sv, len);
-         n_chars = sprintull(ptr, n_ret);
-         av_push(ret, newSVpvn(ptr, n_chars));
+// Enable the phase timers, for --stats.
 
+void set_stats(int on)
+{
+   stats_on = on;
+}
+
+// Phase timers, one row per thread: nanoseconds spent sieving, counting,
+// formatting, and writing; the number of blocks and chunks; and for
+// native threads, the busy and tail time in nanoseconds (otherwise 0).
+// Returns the calling thread's row, or after practicalsieve_parallel,
+// a row per native thread. The timers are reset.
+
+#define STAT_ROW (STAT_PHASES + 4)
+
+static uint64_t *native_rows;
+static int      native_n_rows;
+
+SV* practicalsieve_stats()
+{
+   AV *ret = newAV(), *row;
+   uint64_t own[STAT_ROW], *r;
+   int i, j, n_rows;
+
+   if (native_n_rows > 0) {
+      r = native_rows, n_rows = native_n_rows;
+   }
+   else {
+      memset(own, 0, sizeof(own)), memcpy(own, stats_ns, sizeof(stats_ns));
+      own[STAT_PHASES] = stats_blocks, own[STAT_PHASES + 1] = stats_chunks;
+      r = own, n_rows = 1;
+   }
+
+   for (i = 0; i < n_rows; i++, r += STAT_ROW) {
+      row = newAV();
+      for (j = 0; j < STAT_ROW; j++)
+      #ifdef __LP64__
+         av_push(row, newSVuv(r[j]));
+      #else
+         av_push(row, newSVnv((double) r[j]));
       #endif
+      av_push(ret, newRV_noinc((SV *) row));
    }
 
+   if (native_n_rows > 0)
+      free((void *) native_rows), native_rows = NULL, native_n_rows = 0;
+
+   stats_reset();
+
    return newRV_noinc((SV *) ret);
 }
 
+static int sieve_chunk(
+      uint64_t start, uint64_t limit, int run_mode, int fd, sum_t *n_ptr )
+{
+   sum_t    n_ret;
+   uint64_t low, high, j_off, j_beg, n_off, M1, M1_end, M1_sub, W;
+   uint64_t c, k, t, j, ij, ij0, bits, cnt;
+   int64_t  q, M2, i, i_max, mem_sz, s_off, s_len, n, n_small, n_tiny, w;
+   int64_t  b, bb, n_blocks, n_list, n_carry;
+   bucket_t **heads, *pool, *bk, *next;
+   bprime_t *cl;
+   sprime_t *sp;
+   uint64_t *p_buf;
+   byte_t   *sieve;
+   char     *buf;
+   int      err, len, resume;
+   uint64_t t_lap, t_write;
+
+   n_ret = 0, err = 0, len = 0, buf = NULL, p_buf = NULL;
+   t_lap = stats_clock(), stats_chunks++;
+
+   //====================================================================
+   // Small sieving primes. A stride (t) no larger than the block
+   // means the prime hits every block; compute its starting offset
+   // once for the chunk and carry it forward thereafter.
+   //====================================================================
+
+   q = sqrt(limit) / 3, i_max = SIEVE_sz / 18;
+
+   if (i_max > SP_max) i_max = SP_max;
+
+   // Sized the same for every chunk, so the entries are kept.
+   sp = (sprime_t *) arena_get(ARENA_SPRIME,
+      sizeof(sprime_t) * (i_max > 5 ? i_max - 5 : 1));
+
+   if (i_max > q) i_max = q;
+
+   // Resume from the chunk before, if it ended at start - 1.
+   cl = NULL, n_carry = 0;
+
+   if (q <= SP_max && SP_cnt * (int64_t) sizeof(bprime_t) <= CARRY_MAX_SZ)
+      cl = (bprime_t *) arena_get(ARENA_CARRY,
+         sizeof(bprime_t) * (SP_cnt > 0 ? SP_cnt : 1));
+
+   resume = (cl != NULL && carry.next == start && carry.gen == sieve_gen);
+   carry.next = 0;
+
+   j_beg = (start - 1) / 3, n_small = 0;
+   i = 0, n_list = 0;
+
+   if (resume)
+      i = carry.i_small, n_list = n_small = carry.n_small;
+
+   // Walk the sieving-prime list, beginning with 29 (i = 9). The square
+   // of prime 3i + k is at index (3i + k)^2 / 3.
+   for (; n_list < SP_cnt; n_list++) {
+      if (i + sp_delta[n_list] > i_max)
+         break;
+
+      i += sp_delta[n_list], k = 1 + (i & 1);
+      j  = (3 * i + k) * (3 * i + k) / 3;
+      ij = 2 * i * (3 - k) + 1, t = 2 * (3 * i + k);
+
+      // Skip numbers before this chunk.
+      if (j < j_beg) {
+         j += (j_beg - j) / t * t + ij, ij = t - ij;
+         if (j < j_beg)
+            j += ij, ij = t - ij;
+      }
+      sp[n_small].j = j, sp[n_small].ij = ij, sp[n_small].t = t;
+      n_small++;
+   }
+
+   carry.n_small = n_small, carry.i_small = i;
+
+   // Primes sieved per L1 sized piece rather than per block. The list
+   // is in order of increasing stride.
+   for (n_tiny = 0; n_tiny < n_small; n_tiny++) {
+      if (sp[n_tiny].t > L1D_sz * 8)
+         break;
+   }
+
+   //====================================================================
+   // Large sieving primes. Distribute each into the bucket of the block
+   // holding its first multiple inside the chunk; primes with no
+   // multiple in the chunk are dropped here, or carried.
+   //====================================================================
+
+   W = SIEVE_sz / 3, M1_end = limit / 3;
+   n_blocks = (limit - start) / SIEVE_sz + 1;
+
+   heads = (bucket_t **) arena_get(ARENA_HEADS, n_blocks * sizeof(bucket_t *));
+   pool  = bucket_spare;
+
+   memset(heads, 0, n_blocks * sizeof(bucket_t *));
+
+   if (resume) {
+      // Carried primes, relative to j_beg (the last index carried from).
+      for (n = 0; n < carry.n_carry; n++) {
+         j = j_beg + cl[n].pos;
+
+         if (j <= M1_end) {
+            b = (j - j_beg - 1) / W;
+            bucket_push(heads, &pool, b, j - j_beg - b * W, cl[n].i);
+         }
+         else {
+            cl[n_carry].pos = j - M1_end, cl[n_carry].i = cl[n].i;
+            n_carry++;
+         }
+      }
+
+      // The remaining primes start past those walked before.
+      if (carry.n_list > n_list)
+         n_list = carry.n_list, i = carry.i_list;
+   }
+
+   for (; n_list < SP_cnt; n_list++) {
+      if (i + sp_delta[n_list] > q)
+         break;
+
+      i += sp_delta[n_list], k = 1 + (i & 1);
+      j  = (3 * i + k) * (3 * i + k) / 3;
+      ij = 2 * i * (3 - k) + 1, t = 2 * (3 * i + k);
+
+      bucket_first(heads, &pool, i, j, ij, t, j_beg, M1_end, W, cl, &n_carry);
+   }
+
+   carry.n_list = n_list, carry.i_list = i;
+
+   // The list ends at QP_LIMIT. Beyond that, all indices are candidates,
+   // skipping multiples of 5.
+   if (q > SP_max) {
+      i = SP_max, k = 1 + (i & 1);
+      c = (3 * i + k) * (3 * i + k) / 3, t = 2 * (3 * i + k);
+
+      for (i = SP_max + 1; i <= q; i++) {
+         k  = 3 - k, c = 4 * k * i + c, j = c;
+         ij = 2 * i * (3 - k) + 1, t = 4 * k + t;
+
+         if ((3 * i + k) % 5 == 0)
+            continue;
+
+         bucket_first(heads, &pool, i, j, ij, t, j_beg, M1_end, W, NULL, 0);
+      }
+   }
+
+   //====================================================================
+   // One sieve (and print buffer) for the entire chunk, reused from the
+   // thread's arena.
+   //====================================================================
+
+   // The extra 8 bytes allow reading the sieve a word at a time.
+   mem_sz = (SIEVE_sz / 3 + 2 + 7) / 8;
+   sieve = (byte_t *) arena_get(ARENA_SIEVE, mem_sz + 8);
+
+   if (run_mode == MODE_PRINT) {
+      buf = (char *) arena_get(ARENA_PRINT, FLUSH_LIMIT + 216);
+      p_buf = (uint64_t *) arena_get(ARENA_BATCH,
+         sizeof(uint64_t) * PRINT_BATCH);
+   }
+
+   for (low = start, b = 0; ; low += SIEVE_sz, b++) {
+      high = (limit - low < SIEVE_sz) ? limit : low + SIEVE_sz - 1;
+
+      //=================================================================
+      // Sieve algorithm.
+      //=================================================================
+
+      M1 = high / 3;
+      M2 = (high + (high & 1) - low) / 3;
+      n_off = low - 1, j_off = n_off / 3;
+      mem_sz = (M2 + 2 + 7) / 8;
+
+      // Copy pre-sieved data into sieve, one L1 sized piece at a time,
+      // clearing the primes whose stride fits inside the piece.
+      for (s_off = 0; s_off < mem_sz; s_off += L1D_sz) {
+         s_len = (mem_sz - s_off < L1D_sz) ? mem_sz - s_off : L1D_sz;
+         memcpy(sieve + s_off, pre_sieve17 + s_off, s_len);
+         pre_sieve_and(sieve + s_off, j_off + s_off * 8, s_len);
+
+         M1_sub = j_off + (s_off + s_len) * 8 - 1;
+         if (M1_sub > M1) M1_sub = M1;
+
+         kern.cross6(sieve, sp, 0, n_tiny, j_off, M1_sub);
+      }
+
+      // Fix byte 0 if starting at 1 (has primes 5,7,11,13,17,19,23).
+      if (low == 1) sieve[0] = 0xfe;
+
+      // The tiled pattern also clears 19 and 23 (i = 6 and 7) themselves.
+      for (i = 6; i <= 7; i++) {
+         if (i > j_off) SETBIT(sieve, i - j_off);
+      }
+
+      // Unset bits > high.
+      i = mem_sz * 8 - (M2 + 2);
+
+      while (i) {
+         CLEARBIT(sieve, (mem_sz - 1) * 8 + (8 - i));
+         i--;
+      }
+
+      // Clear composites < FROM_val.
+      if (low == FROM_adj) {
+         for (i = 1; i <= 3; i++) {
+            if (n_off + (3 * i + 1 | 1) >= FROM_val)
+               break;
+            CLEARBIT(sieve, i);
+         }
+      }
+
+      // Clear composites > N_val.
+      if (high == N_val) {
+         if (n_off + (3 * (M2 + 1) + 1) > N_val + (N_val & 1))
+            CLEARBIT(sieve, M2 + 1);
+         if (n_off + (3 * M2 + 2) > N_val + (N_val & 1))
+            CLEARBIT(sieve, M2);
+      }
+
+      // Process this block for the remaining small primes.
+      kern.cross6(sieve, sp, n_tiny, n_small, j_off, M1);
+
+      // Empty the bucket for this block, moving each prime into the
+      // bucket of the block holding its next multiple.
+      for (bk = heads[b]; bk != NULL; bk = next) {
+         for (n = 0; n < bk->n; n++) {
+            i  = bk->e[n].i & 0x7fffffff, k = (i & 1) ? 2 : 1;
+            t  = 2 * (3 * i + k), ij = ij0 = 2 * i * (3 - k) + 1;
+            j  = j_off + bk->e[n].pos;
+
+            if (bk->e[n].i >> 31)
+               ij = t - ij;
+
+            do {
+               CLEARBIT(sieve, j - j_off);
+               j += ij, ij = t - ij;
+            } while (j <= M1);
+
+            if (j <= M1_end) {
+               bb = (j - j_beg - 1) / W;
+               bucket_push(heads, &pool, bb, j - j_beg - bb * W,
+                  (uint32_t) i | (uint32_t) (ij != ij0) << 31);
+            }
+            else if (cl != NULL) {
+               cl[n_carry].pos = j - M1_end;
+               cl[n_carry].i = (uint32_t) i | (uint32_t) (ij != ij0) << 31;
+               n_carry++;
+            }
+         }
+
+         next = bk->next, bk->next = pool, pool = bk;
+      }
+
+      heads[b] = NULL;
+
+      stats_lap(STAT_SIEVE, &t_lap), stats_blocks++;
+
+      //=================================================================
+      // Count primes, sum primes, otherwise output primes for this block.
+      //=================================================================
+
+      if (run_mode == MODE_COUNT) {
+         if (2 >= low && 2 >= FROM_val && 2 <= N_val)
+            n_ret++;
+         if (3 >= low && 3 >= FROM_val && 3 <= N_val)
+            n_ret++;
+
+         n_ret += popcount(sieve, mem_sz);
+      }
+      else if (run_mode == MODE_SUM) {
+         if (2 >= low && 2 >= FROM_val && 2 <= N_val)
+            n_ret += 2;
+         if (3 >= low && 3 >= FROM_val && 3 <= N_val)
+            n_ret += 3;
+
+         // Visit the set bits a word at a time.
+         memset(sieve + mem_sz, 0, 8);
+
+         n_ret += kern.sum6(sieve, mem_sz, n_off, &cnt);
+      }
+      else {
+         t_write = stats_ns[STAT_WRITE];
+
+         // Think of an imaginary list containing sequence of numbers.
+         // The n_off value is used to determine the starting offset.
+         //
+         // Avoid all composites that have 2 or 3 as one of their prime
+         // factors (where i is odd).
+         //
+         // { 0, 5, 7, 11, 13, ... 3i + 2, 3(i + 1) + 1, ..., N }
+         //   0, 1, 2,  3,  4, ... list indices (0 is not used)
+         //
+         // That is 3i + 2 for odd i and 3i + 1 for even i.
+
+         if (2 >= low && 2 >= FROM_val && 2 <= N_val)
+            write_output(fd, buf, 2, &len), n_ret++;
+         if (3 >= low && 3 >= FROM_val && 3 <= N_val)
+            write_output(fd, buf, 3, &len), n_ret++;
+
+         // Collect primes and output them in batches.
+         memset(sieve + mem_sz, 0, 8);
+
+         w = 0, bits = load_word(sieve);
+
+         while ((n = kern.list6(sieve, mem_sz, n_off, &w, &bits,
+               p_buf, PRINT_BATCH)) > 0) {
+            if ((err = write_output_batch(fd, buf, p_buf, n, &len)))
+               break;
+            n_ret += n;
+         }
+
+         // Writes made while formatting are timed on their own.
+         stats_ns[STAT_FORMAT] -= stats_ns[STAT_WRITE] - t_write;
+      }
+
+      stats_lap((run_mode == MODE_PRINT) ? STAT_FORMAT : STAT_COUNT, &t_lap);
+
+      if (err || high == limit)
+         break;
+   }
+
+   if (run_mode == MODE_PRINT) {
+      if (!err)
+         err = flush_output(fd, buf, &len);
+   }
+
+   // Buckets remain in blocks not reached, after an error.
+   for (b = 0; b < n_blocks; b++)
+      bucket_recycle(heads[b], &pool);
+
+   bucket_spare = pool;
+
+   if (cl != NULL && !err) {
+      carry.next = limit + 1, carry.gen = sieve_gen;
+      carry.n_carry = n_carry;
+   }
+
+   *n_ptr = n_ret;
+
+   return err;
+}
+
+//#############################################################################
+// ----------------------------------------------------------------------------
+// Mod-30 wheel sieve. An alternative engine to sieve_chunk, sharing the
+// sieving-prime list, popcount, and output paths. Multiples of 2, 3, and 5
+// are not stored; 7, 11, 13, and 17 are pre-sieved. A prime's multiples
+// p * m, for m coprime to 30, advance by table lookup: the residue of m
+// selects the bit, and the byte advances by a * gap plus a carry.
+//
+//#############################################################################
+
+static const byte_t w30_res[8] = { 1, 7, 11, 13, 17, 19, 23, 29 };
+static const byte_t w30_gap[8] = { 6, 4,  2,  4,  2,  4,  6,  2 };
+
+// Bit index of each residue (8 if not coprime to 30), the distance to the
+// next residue coprime to 30, and for prime residue ri, multiplier residue
+// wi: the bit of p * m and the carry into the byte of its next multiple.
+
+static byte_t w30_idx[30], w30_next[30];
+static byte_t w30_mask[8][8], w30_adj[8][8];
+
+// Build the tables and the pre-sieve pattern, once.
+
+static void wheel_init(void)
+{
+   int64_t i, n;
+   int     k, ri, wi, r, m;
+
+   if (pre_sieve30 != NULL)
+      return;
+
+   for (r = 0; r < 30; r++)
+      w30_idx[r] = 8;
+   for (k = 0; k < 8; k++)
+      w30_idx[w30_res[k]] = k;
+
+   for (r = 0; r < 30; r++) {
+      for (k = 0; w30_idx[(r + k) % 30] == 8; k++) ;
+      w30_next[r] = k;
+   }
+
+   for (ri = 0; ri < 8; ri++) {
+      for (wi = 0; wi < 8; wi++) {
+         r = w30_res[ri], m = r * w30_res[wi] % 30;
+         w30_mask[ri][wi] = 1 << w30_idx[m];
+         w30_adj[ri][wi]  = (m + r * w30_gap[wi]) / 30;
+      }
+   }
+
+   // Byte i of the pattern is for numbers 30i through 30i + 29.
+   pre_sieve30 = (byte_t *) malloc(2 * PS30_LEN);
+
+   for (i = 0; i < 2 * PS30_LEN; i++) {
+      pre_sieve30[i] = 0xff;
+
+      for (k = 0; k < 8; k++) {
+         n = 30 * (i % PS30_LEN) + w30_res[k];
+
+         if (n % 7 == 0 || n % 11 == 0 || n % 13 == 0 || n % 17 == 0)
+            pre_sieve30[i] &= unset_bit[k];
+      }
+   }
+}
+
+// Select the sieve engine: 6 (Algorithm3, default) or 30 (mod-30 wheel).
+// Call before practicalsieve_precalc.
+
+void set_wheel(int w)
+{
+   wheel = (w == 30) ? 30 : 6;
+
+   if (wheel == 30)
+      wheel_init();
+}
+
+// Copy the pre-sieve pattern into len bytes of the sieve, whose first
+// byte is for numbers 30g through 30g + 29.
+
+static void pre_sieve30_copy(byte_t *dst, uint64_t g, int64_t len)
+{
+   const byte_t *pat = pre_sieve30 + g % PS30_LEN;
+   int64_t n;
+
+   for (; len > 0; dst += n, len -= n) {
+      n = (len < PS30_LEN) ? len : PS30_LEN;
+      memcpy(dst, pat, n);
+   }
+}
+
+// Find the first multiple p * m >= base, m >= p and coprime to 30, as the
+// byte offset from base (a multiple of 30) and the residue index of m.
+// Returns 0 if past limit.
+
+static int wheel_first(
+      uint64_t p, uint64_t base, uint64_t limit, uint64_t *off, int *wi )
+{
+   uint64_t m = base / p;
+
+   if (m * p < base) m++;
+   if (m < p) m = p;
+
+   m += w30_next[m % 30];
+
+   if (m > limit / p)
+      return 0;
+
+   *off = (p * m - base) / 30, *wi = w30_idx[m % 30];
+
+   return 1;
+}
+
+// Push the sieving prime of index i into the bucket of the block holding
+// its first multiple inside the chunk, if any.
+
+static void wheel_bucket_first(
+      bucket_t **heads, bucket_t **pool, int64_t i, uint64_t base,
+      uint64_t limit, uint64_t W )
+{
+   uint64_t off;
+   int64_t  b;
+   int      wi;
+
+   if (wheel_first(3 * i + 1 + (i & 1), base, limit, &off, &wi)) {
+      b = off / W;
+      bucket_push(heads, pool, b,
+         (uint32_t) (off - b * W) | (uint32_t) wi << WPOS_BITS,
+         (uint32_t) i);
+   }
+}
+
+// Clear the multiples of a small sieving prime before byte end. A whole
+// turn of the wheel (8 multiples) spans p bytes, so the turn is unrolled
+// with the offsets and masks from the current residue.
+
+KERNEL_INLINE void wheel_cross(byte_t *sieve, wprime_t *sp, uint64_t end)
+{
+   const byte_t *mask = w30_mask[sp->ri], *adj = w30_adj[sp->ri];
+   uint64_t off = sp->off, a = sp->a, d[8], p, x;
+   byte_t   *s, m[8];
+   int      wi = sp->wi, k;
+
+   for (k = 0, p = 0; k < 8; k++) {
+      x = (wi + k) & 7, d[k] = p, m[k] = ~mask[x];
+      p += a * w30_gap[x] + adj[x];
+   }
+
+   for (; off + d[7] < end; off += p) {
+      s = sieve + off;
+      s[d[0]] &= m[0], s[d[1]] &= m[1], s[d[2]] &= m[2], s[d[3]] &= m[3];
+      s[d[4]] &= m[4], s[d[5]] &= m[5], s[d[6]] &= m[6], s[d[7]] &= m[7];
+   }
+
+   while (off < end) {
+      sieve[off] &= ~mask[wi];
+      off += a * w30_gap[wi] + adj[wi], wi = (wi + 1) & 7;
+   }
+
+   sp->off = off, sp->wi = wi;
+}
+
+// The bits to keep in a byte whose first number is n, for [lo, hi].
+
+static byte_t wheel_keep(uint64_t n, uint64_t lo, uint64_t hi)
+{
+   byte_t keep = 0;
+   int    k;
+
+   for (k = 0; k < 8; k++) {
+      if (n + w30_res[k] >= lo && n + w30_res[k] <= hi)
+         keep |= 1 << k;
+   }
+
+   return keep;
+}
+
+//#############################################################################
+// ----------------------------------------------------------------------------
+// Kernels. The Inline::C build has no -march flag, as MinGW rejects
+// -march=native and one .Inline directory may serve hosts of different
+// kinds. Instead, the inner loops of both engines are compiled once per
+// ISA level through the target attribute, and kernels_init picks the
+// level of the running cpu before any worker starts:
+//
+//   x86-64-v3  AVX2, BMI1, BMI2, POPCNT (Haswell, Zen); tzcnt and
+//              blsr for visiting the set bits, shrx for the bit offsets
+//   base       the compiler's target (SSE2 on x86-64; on AArch64, NEON
+//              and rbit + clz are the base ISA, so there is one level)
+//
+// Each kernel does one task, so the run mode is decided per block, not
+// per bit. The sums add up the offsets from the block start in 64 bits,
+// adding the count times the block start once at the end. Listing stops
+// at cap and resumes from word w with the bits left in it.
+//
+//#############################################################################
+
+// Cross off sp[n_beg, n_end) through index M1, for the block at j_off.
+
+KERNEL_INLINE void cross6_body(
+      byte_t *sieve, sprime_t *sp, int64_t n_beg, int64_t n_end,
+      uint64_t j_off, uint64_t M1 )
+{
+   uint64_t j, ij, t;
+   int64_t  n;
+
+   for (n = n_beg; n < n_end; n++) {
+      j = sp[n].j, ij = sp[n].ij, t = sp[n].t;
+
+      while (j <= M1) {
+         CLEARBIT(sieve, j - j_off);
+         j += ij, ij = t - ij;
+      }
+
+      sp[n].j = j, sp[n].ij = ij;
+   }
+}
+
+KERNEL_INLINE sum_t sum6_body(
+      const byte_t *sieve, int64_t mem_sz, uint64_t n_off, uint64_t *count )
+{
+   uint64_t bits, s = 0, c = 0;
+   int64_t  w, i;
+
+   for (w = 0; w < mem_sz; w += 8) {
+      bits = load_word(sieve + w), c += POPCNT64(bits);
+
+      while (bits) {
+         i = w * 8 + CTZ64(bits), bits &= bits - 1;
+         s += 3 * i + 1 + (i & 1);
+      }
+   }
+
+   *count = c;
+
+   return (sum_t) c * n_off + s;
+}
+
+KERNEL_INLINE int64_t list6_body(
+      const byte_t *sieve, int64_t mem_sz, uint64_t n_off, int64_t *w_ptr,
+      uint64_t *bits_ptr, uint64_t *out, int64_t cap )
+{
+   uint64_t bits = *bits_ptr;
+   int64_t  w = *w_ptr, i, n = 0;
+
+   for (;;) {
+      while (bits && n < cap) {
+         i = w * 8 + CTZ64(bits), bits &= bits - 1;
+         out[n++] = n_off + (3 * i + 1 + (i & 1));
+      }
+
+      if (n == cap || (w += 8) >= mem_sz)
+         break;
+
+      bits = load_word(sieve + w);
+   }
+
+   *w_ptr = w, *bits_ptr = bits;
+
+   return n;
+}
+
+// Cross off sp[n_beg, n_end) through byte end, then shift the offsets.
+
+KERNEL_INLINE void cross30_body(
+      byte_t *sieve, wprime_t *sp, int64_t n_beg, int64_t n_end,
+      uint64_t end, uint64_t shift )
+{
+   int64_t n;
+
+   for (n = n_beg; n < n_end; n++) {
+      wheel_cross(sieve, &sp[n], end);
+      sp[n].off -= shift;
+   }
+}
+
+KERNEL_INLINE sum_t sum30_body(
+      const byte_t *sieve, int64_t bytes, uint64_t blk_lo, uint64_t *count )
+{
+   uint64_t bits, s = 0, c = 0;
+   int64_t  w, k;
+
+   for (w = 0; w < bytes; w += 8) {
+      bits = load_word(sieve + w), c += POPCNT64(bits);
+
+      while (bits) {
+         k = CTZ64(bits), bits &= bits - 1;
+         s += 30 * (w + (k >> 3)) + w30_res[k & 7];
+      }
+   }
+
+   *count = c;
+
+   return (sum_t) c * blk_lo + s;
+}
+
+KERNEL_INLINE int64_t list30_body(
+      const byte_t *sieve, int64_t bytes, uint64_t blk_lo, int64_t *w_ptr,
+      uint64_t *bits_ptr, uint64_t *out, int64_t cap )
+{
+   uint64_t bits = *bits_ptr;
+   int64_t  w = *w_ptr, k, n = 0;
+
+   for (;;) {
+      while (bits && n < cap) {
+         k = CTZ64(bits), bits &= bits - 1;
+         out[n++] = blk_lo + 30 * (w + (k >> 3)) + w30_res[k & 7];
+      }
+
+      if (n == cap || (w += 8) >= bytes)
+         break;
+
+      bits = load_word(sieve + w);
+   }
+
+   *w_ptr = w, *bits_ptr = bits;
+
+   return n;
+}
+
+// One copy of every kernel per ISA level, with the given attribute.
+
+#define KERNELS(attr, lvl) \
+   attr static void cross6_##lvl(byte_t *sieve, sprime_t *sp, \
+         int64_t n_beg, int64_t n_end, uint64_t j_off, uint64_t M1) \
+   { cross6_body(sieve, sp, n_beg, n_end, j_off, M1); } \
+   \
+   attr static sum_t sum6_##lvl(const byte_t *sieve, int64_t mem_sz, \
+         uint64_t n_off, uint64_t *count) \
+   { return sum6_body(sieve, mem_sz, n_off, count); } \
+   \
+   attr static int64_t list6_##lvl(const byte_t *sieve, int64_t mem_sz, \
+         uint64_t n_off, int64_t *w, uint64_t *bits, uint64_t *out, \
+         int64_t cap) \
+   { return list6_body(sieve, mem_sz, n_off, w, bits, out, cap); } \
+   \
+   attr static void cross30_##lvl(byte_t *sieve, wprime_t *sp, \
+         int64_t n_beg, int64_t n_end, uint64_t end, uint64_t shift) \
+   { cross30_body(sieve, sp, n_beg, n_end, end, shift); } \
+   \
+   attr static sum_t sum30_##lvl(const byte_t *sieve, int64_t bytes, \
+         uint64_t blk_lo, uint64_t *count) \
+   { return sum30_body(sieve, bytes, blk_lo, count); } \
+   \
+   attr static int64_t list30_##lvl(const byte_t *sieve, int64_t bytes, \
+         uint64_t blk_lo, int64_t *w, uint64_t *bits, uint64_t *out, \
+         int64_t cap) \
+   { return list30_body(sieve, bytes, blk_lo, w, bits, out, cap); }
+
+#define KERNELS_SET(k, lvl) \
+   (k).cross6 = cross6_##lvl, (k).sum6 = sum6_##lvl, \
+   (k).list6 = list6_##lvl, (k).cross30 = cross30_##lvl, \
+   (k).sum30 = sum30_##lvl, (k).list30 = list30_##lvl, (k).isa = #lvl
+
+KERNELS(, base)
+
+#if defined(POPCOUNT_X86)
+KERNELS(__attribute__((target("avx2,bmi,bmi2,popcnt"))), x86_64_v3)
+#endif
+
+static void kernels_init(void)
+{
+   if (kern.isa != NULL)
+      return;
+
+#if defined(POPCOUNT_X86)
+   __builtin_cpu_init();
+
+   if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi") &&
+         __builtin_cpu_supports("bmi2") &&
+         __builtin_cpu_supports("popcnt")) {
+      KERNELS_SET(kern, x86_64_v3);
+      return;
+   }
+#endif
+
+   KERNELS_SET(kern, base);
+}
+
+// The ISA level of the kernels in use, for reporting.
+
+char* practicalsieve_isa()
+{
+   kernels_init();
+
+   return (char *) kern.isa;
+}
+
+static THREAD_LOCAL fill_t fill;
+
+// The number of primes summed by the last call in MODE_SUM, for
+// index_chunk.
+
+static THREAD_LOCAL uint64_t sum_n;
+
+static int wheel_chunk(
+      uint64_t start, uint64_t limit, int run_mode, int fd, sum_t *n_ptr )
+{
+   static const uint64_t w30_small[3] = { 2, 3, 5 };
+
+   sum_t    n_ret;
+   uint64_t lo, hi, base, blk_lo, c_bytes, off, pos, a, bits, cnt, v, W;
+   int64_t  q, i, i_max, n, n_small, n_tiny, n_list, s_off, s_len, s_end;
+   int64_t  b, bb, n_blocks, bytes, w, k;
+   bucket_t **heads, *pool, *bk, *next;
+   wprime_t *sp;
+   uint64_t *p_buf;
+   byte_t   *sieve;
+   char     *buf;
+   int      err, len, ri, wi, full;
+   uint64_t t_lap, t_write;
+
+   n_ret = 0, err = 0, len = 0, buf = NULL, p_buf = NULL, sum_n = 0;
+   t_lap = stats_clock(), stats_chunks++;
+
+   // The sieving-prime slot of the arena is shared with sieve_chunk, so
+   // its carried offsets are lost past here.
+   carry.next = 0;
+
+   // Chunks may begin before FROM_val; bytes straddle chunk boundaries.
+   lo = (start < FROM_val) ? FROM_val : start, hi = limit;
+   base = start - start % 30;
+
+   W = SIEVE_sz / 30, c_bytes = (limit - base) / 30 + 1;
+   n_blocks = (c_bytes - 1) / W + 1;
+
+   //====================================================================
+   // Small sieving primes: 19, 23, and the list through i_max, with
+   // offsets relative to the current block, carried between blocks.
+   //====================================================================
+
+   q = sqrt(limit) / 3, i_max = SIEVE_sz / 18;
+
+   if (i_max > SP_max) i_max = SP_max;
+
+   sp = (wprime_t *) arena_get(ARENA_SPRIME, sizeof(wprime_t) * (i_max + 2));
+
+   if (i_max > q) i_max = q;
+
+   for (n_small = 0, k = 19; k <= 23; k += 4) {
+      sp[n_small].a = k / 30, sp[n_small].ri = w30_idx[k % 30];
+      if (!wheel_first(k, base, limit, &off, &wi))
+         off = c_bytes, wi = 0;
+      sp[n_small].off = off, sp[n_small].wi = wi;
+      n_small++;
+   }
+
+   for (i = 0, n_list = 0; n_list < SP_cnt; n_list++) {
+      if (i + sp_delta[n_list] > i_max)
+         break;
+
+      i += sp_delta[n_list], a = 3 * i + 1 + (i & 1);
+
+      if (!wheel_first(a, base, limit, &off, &wi))
+         continue;
+
+      sp[n_small].a = a / 30, sp[n_small].ri = w30_idx[a % 30];
+      sp[n_small].off = off, sp[n_small].wi = wi;
+      n_small++;
+   }
+
+   // Primes sieved per L1 sized piece rather than per block.
+   for (n_tiny = 0; n_tiny < n_small; n_tiny++) {
+      if (sp[n_tiny].a * 6 + 6 > L1D_sz)
+         break;
+   }
+
+   //====================================================================
+   // Large sieving primes, into the bucket of the block holding their
+   // first multiple inside the chunk. Beyond the list (QP_LIMIT), all
+   // indices are candidates, skipping multiples of 5.
+   //====================================================================
+
+   heads = (bucket_t **) arena_get(ARENA_HEADS, n_blocks * sizeof(bucket_t *));
+   pool  = bucket_spare;
+
+   memset(heads, 0, n_blocks * sizeof(bucket_t *));
+
+   for (; n_list < SP_cnt; n_list++) {
+      if (i + sp_delta[n_list] > q)
+         break;
+
+      i += sp_delta[n_list];
+      wheel_bucket_first(heads, &pool, i, base, limit, W);
+   }
+
+   if (q > SP_max) {
+      for (i = SP_max + 1; i <= q; i++) {
+         if ((3 * i + 1 + (i & 1)) % 5 != 0)
+            wheel_bucket_first(heads, &pool, i, base, limit, W);
+      }
+   }
+
+   //====================================================================
+   // One sieve (and print buffer) for the entire chunk, reused from the
+   // thread's arena.
+   //====================================================================
+
+   // The extra 8 bytes allow reading the sieve a word at a time.
+   sieve = (byte_t *) arena_get(ARENA_SIEVE, W + 8);
+
+   if (run_mode == MODE_PRINT) {
+      buf = (char *) arena_get(ARENA_PRINT, FLUSH_LIMIT + 216);
+      p_buf = (uint64_t *) arena_get(ARENA_BATCH,
+         sizeof(uint64_t) * PRINT_BATCH);
+   }
+
+   // The primes 2, 3, and 5 are not in the wheel.
+   for (k = 0, full = 0; k < 3 && !err && !full; k++) {
+      if (w30_small[k] < lo || w30_small[k] > hi)
+         continue;
+
+      if (run_mode == MODE_PRINT)
+         err = write_output(fd, buf, w30_small[k], &len), n_ret++;
+      else if (run_mode == MODE_FILL && fill.n == fill.cap)
+         fill.next = w30_small[k], full = 1;
+      else if (run_mode == MODE_FILL)
+         fill.dst[fill.n++] = w30_small[k], n_ret++;
+      else if (run_mode == MODE_SUM)
+         n_ret += w30_small[k], sum_n++;
+      else
+         n_ret++;
+   }
+
+   for (b = 0; b < n_blocks && !err && !full; b++) {
+      bytes  = (c_bytes - b * W < W) ? c_bytes - b * W : W;
+      blk_lo = base + 30 * (b * W);
+
+      //=================================================================
+      // Sieve algorithm.
+      //=================================================================
+
+      // Copy pre-sieved data into sieve, one L1 sized piece at a time,
+      // clearing the primes whose stride fits inside the piece.
+      for (s_off = 0; s_off < bytes; s_off += L1D_sz) {
+         s_len = (bytes - s_off < L1D_sz) ? bytes - s_off : L1D_sz;
+         s_end = s_off + s_len;
+
+         pre_sieve30_copy(sieve + s_off, blk_lo / 30 + s_off, s_len);
+         kern.cross30(sieve, sp, 0, n_tiny, s_end, 0);
+      }
+
+      // Byte 0 has 7, 11, 13, and 17, cleared by the pattern, but not 1.
+      if (blk_lo == 0) sieve[0] = 0xfe;
+
+      // Process this block for the remaining small primes.
+      kern.cross30(sieve, sp, 0, n_small, bytes, bytes);
+
+      // Empty the bucket for this block, moving each prime into the
+      // bucket of the block holding its next multiple.
+      for (bk = heads[b]; bk != NULL; bk = next) {
+         for (n = 0; n < bk->n; n++) {
+            i   = bk->e[n].i, v = 3 * i + 1 + (i & 1);
+            a   = v / 30, ri = w30_idx[v % 30];
+            off = bk->e[n].pos & ((1 << WPOS_BITS) - 1);
+            wi  = bk->e[n].pos >> WPOS_BITS;
+
+            do {
+               sieve[off] &= ~w30_mask[ri][wi];
+               off += a * w30_gap[wi] + w30_adj[ri][wi], wi = (wi + 1) & 7;
+            } while (off < (uint64_t) bytes);
+
+            pos = b * W + off;
+
+            if (pos < c_bytes) {
+               bb = pos / W;
+               bucket_push(heads, &pool, bb,
+                  (uint32_t) (pos - bb * W) | (uint32_t) wi << WPOS_BITS,
+                  (uint32_t) i);
+            }
+         }
+
+         next = bk->next, bk->next = pool, pool = bk;
+      }
+
+      heads[b] = NULL;
+
+      // Clear numbers outside [lo, hi].
+      if (b == 0) {
+         k = (lo - base) / 30;
+         memset(sieve, 0, k);
+         sieve[k] &= wheel_keep(base + 30 * k, lo, hi);
+      }
+      if (b == n_blocks - 1) {
+         k = bytes - 1;
+         sieve[k] &= wheel_keep(blk_lo + 30 * k, lo, hi);
+      }
+
+      stats_lap(STAT_SIEVE, &t_lap), stats_blocks++;
+
+      //=================================================================
+      // Count primes, sum primes, otherwise output primes for this block.
+      // Bit k of the word at byte w is 30 * (w + k / 8) + w30_res[k % 8].
+      //=================================================================
+
+      memset(sieve + bytes, 0, 8);
+
+      if (run_mode == MODE_COUNT) {
+         n_ret += popcount(sieve, bytes);
+      }
+      else if (run_mode == MODE_SUM) {
+         n_ret += kern.sum30(sieve, bytes, blk_lo, &cnt);
+         sum_n += cnt;
+      }
+      else if (run_mode == MODE_FILL) {
+         w = 0, bits = load_word(sieve);
+
+         n = kern.list30(sieve, bytes, blk_lo, &w, &bits,
+            fill.dst + fill.n, fill.cap - fill.n);
+         fill.n += n, n_ret += n;
+
+         // Once full, the prime after the last one stored is the next.
+         if (fill.n == fill.cap &&
+               kern.list30(sieve, bytes, blk_lo, &w, &bits, &v, 1) > 0)
+            fill.next = v, full = 1;
+      }
+      else {
+         t_write = stats_ns[STAT_WRITE];
+
+         w = 0, bits = load_word(sieve);
+
+         while ((n = kern.list30(sieve, bytes, blk_lo, &w, &bits,
+               p_buf, PRINT_BATCH)) > 0) {
+            if ((err = write_output_batch(fd, buf, p_buf, n, &len)))
+               break;
+            n_ret += n;
+         }
+
+         // Writes made while formatting are timed on their own.
+         stats_ns[STAT_FORMAT] -= stats_ns[STAT_WRITE] - t_write;
+      }
+
+      stats_lap((run_mode == MODE_PRINT) ? STAT_FORMAT : STAT_COUNT, &t_lap);
+   }
+
+   if (run_mode == MODE_PRINT) {
+      if (!err)
+         err = flush_output(fd, buf, &len);
+   }
+
+   // Buckets remain in blocks not reached, after an error.
+   for (b = 0; b < n_blocks; b++)
+      bucket_recycle(heads[b], &pool);
+
+   bucket_spare = pool;
+
+   *n_ptr = n_ret;
+
+   return err;
+}
+
+// A count or sum as an SV, given as a decimal string if wider than UV.
+
+static SV* sum_sv(sum_t n)
+{
+#if SUM_BITS > 64
+   if (n > UINT64_MAX) {
+      char buf[N_MAXDIGITS128 + 1];
+      return newSVpvn(buf, sprintu128(buf, n));
+   }
+#endif
+
+   #ifdef __LP64__
+      return newSVuv(n);
+
+   #else
+   {
+      char buf[N_MAXDIGITS + 1];
+      return newSVpvn(buf, sprintull(buf, n));
+   }
+   #endif
+}
+
+static SV* sieve_result(int run_mode, sum_t n_ret, int err)
+{
+   AV *ret = newAV();
+
+   if (run_mode == MODE_PRINT)
+      av_push(ret, newSViv(err));
+   else
+      av_push(ret, sum_sv(n_ret));
+
+   return newRV_noinc((SV *) ret);
+}
+
+// Process an entire MCE chunk. The block loop runs here, reusing one
+// sieve buffer and carrying each small prime's offset between blocks.
+
+SV* practicalsieve_chunk(SV *start_sv, SV *limit_sv, int run_mode, int fd)
+{
+   uint64_t start, limit;
+   sum_t    n_ret;
+   int      err;
+
+   #ifdef __LP64__
+      start = SvUV(start_sv);
+      limit = SvUV(limit_sv);
+   #else
+      start = strtoull(SvPV_nolen(start_sv), NULL, 10);
+      limit = strtoull(SvPV_nolen(limit_sv), NULL, 10);
+   #endif
+
+   err = (wheel == 30)
+      ? wheel_chunk(start, limit, run_mode, fd, &n_ret)
+      : sieve_chunk(start, limit, run_mode, fd, &n_ret);
+
+   if (slot != NULL && run_mode != MODE_PRINT) {
+      slot->agg += n_ret, slot->chunks++;
+      __atomic_store_n(&slot->next, limit + 1, __ATOMIC_RELAXED);
+      __atomic_store_n(&slot->done, slot->done + (limit - start + 1),
+         __ATOMIC_RELEASE);
+   }
+
+   return sieve_result(run_mode, n_ret, err);
+}
+
+//#############################################################################
+// ----------------------------------------------------------------------------
+// Result slots (--shared-results). The manager maps the slots before the
+// workers start; each worker binds its own, and practicalsieve_chunk adds
+// to it in count and sum mode. The manager polls the slots for progress
+// and reduces them once the workers are done.
+//
+//#############################################################################
+
+// Map a slot per worker, shared with forked workers. Returns 0 if shared
+// memory is not available, leaving results to be gathered.
+
+int practicalsieve_slots_init(int n)
+{
+   int mapped;
+
+   if (slots != NULL || n < 1)
+      return (slots != NULL);
+
+   slots = (slot_t *) shared_alloc(sizeof(slot_t) * n, &mapped);
+
+   if (!mapped) {
+      free((void *) slots);
+      slots = NULL;
+      return 0;
+   }
+
+   memset(slots, 0, sizeof(slot_t) * n);
+   n_slots = n;
+
+   return 1;
+}
+
+// Bind worker id (1 based) to its slot, or unbind with id 0.
+
+void practicalsieve_slot_bind(int id)
+{
+   slot = (slots != NULL && id >= 1 && id <= n_slots) ? &slots[id - 1] : NULL;
+}
+
+// The numbers done by all workers, then where each worker's last chunk
+// ended (0 if none yet).
+
+SV* practicalsieve_slots_poll()
+{
+   AV       *ret = newAV();
+   uint64_t done = 0;
+   int      i;
+
+   for (i = 0; i < n_slots; i++)
+      done += __atomic_load_n(&slots[i].done, __ATOMIC_ACQUIRE);
+
+   av_push(ret, sum_sv((sum_t) done));
+
+   for (i = 0; i < n_slots; i++)
+      av_push(ret, sum_sv((sum_t) __atomic_load_n(&slots[i].next,
+         __ATOMIC_RELAXED)));
+
+   return newRV_noinc((SV *) ret);
+}
+
+// The count or sum over all slots, once the workers are done.
+
+SV* practicalsieve_slots_reduce()
+{
+   sum_t agg = 0;
+   int   i;
+
+   for (i = 0; i < n_slots; i++)
+      agg += slots[i].agg;
+
+   return sieve_result(MODE_COUNT, agg, 0);
+}
+
+// Fill buf with up to max_count primes in [from, to] as native uint64
+// values, for unpack 'Q*' or the data of a PDL ulonglong ndarray. Returns
+// the number of primes, the cursor (the from for the next call), and 1 once
+// the range is done. The range is clipped to FROM and N given to
+// practicalsieve_precalc, which must be called first.
+// Sieves by the mod-30 wheel, whichever engine is selected.
+
+SV* practicalsieve_fill(SV *buf_sv, SV *from_sv, SV *to_sv, int max_count)
+{
+   uint64_t from, to, hi;
+   double   span;
+   sum_t    n;
+   SV       *ret;
+
+   #ifdef __LP64__
+      from = SvUV(from_sv);
+      to   = SvUV(to_sv);
+   #else
+      from = strtoull(SvPV_nolen(from_sv), NULL, 10);
+      to   = strtoull(SvPV_nolen(to_sv), NULL, 10);
+   #endif
+
+   wheel_init();
+
+   if (from < FROM_val) from = FROM_val;
+   if (to > N_val) to = N_val;
+   if (max_count < 0) max_count = 0;
+
+   SvUPGRADE(buf_sv, SVt_PV);
+   fill.dst = (uint64_t *) SvGROW(buf_sv, sizeof(uint64_t) * max_count + 1);
+   fill.n = 0, fill.cap = max_count;
+
+   // Sieve about as far as the remaining primes need (x / ln x), going
+   // again if short.
+   while (fill.n < fill.cap && from <= to) {
+      span = (fill.cap - fill.n) * 1.1 * log((double) from + 16) + 1024;
+      hi = (span >= (double) (to - from)) ? to : from + (uint64_t) span;
+
+      fill.next = hi + 1;
+      wheel_chunk(from, hi, MODE_FILL, -1, &n);
+      from = fill.next;
+   }
+
+   SvCUR_set(buf_sv, sizeof(uint64_t) * fill.n);
+   SvPOK_only(buf_sv);
+
+   ret = sieve_result(MODE_COUNT, (sum_t) fill.n, 0);
+   av_push((AV *) SvRV(ret), sum_sv((sum_t) from));
+   av_push((AV *) SvRV(ret), newSViv(from > to));
+
+   return ret;
+}
+
+//#############################################################################
+// ----------------------------------------------------------------------------
+// Native threads. Process the chunks of [start, limit] without MCE, handed
+// out by an atomic counter. In print mode, each thread writes a chunk to
+// its own memory file, then outputs it once all chunks before it are out.
+//
+//#############################################################################
+
+typedef struct {
+   uint64_t start, limit, step;
+   int64_t  n_chunks, next_chunk, next_out, out_off;
+   int      run_mode, fd, positional, numa, err;
+#if !defined(_WIN32)
+   pthread_mutex_t lock;
+   pthread_cond_t  turn;
+#endif
+} native_t;
+
+typedef struct {
+   native_t *nt;
+   sum_t    n_ret;
+   uint64_t stats[STAT_ROW], t_end;
+   int      mem_fd, id;
+} native_arg_t;
+
+static void *native_worker(void *arg)
+{
+   native_arg_t *a = (native_arg_t *) arg;
+   native_t *nt = a->nt;
+   uint64_t lo, hi, t_begin;
+   int64_t  c, size, off;
+   sum_t    n;
+   int      err, fd;
+
+   fd = (a->mem_fd >= 0) ? a->mem_fd : nt->fd;
+   t_begin = stats_clock(), stats_reset();
+
+   // Threads share the tables, so pin without replicating them.
+   if (nt->numa)
+      practicalsieve_numa_bind(a->id, 0);
+
+   for (;;) {
+   #if !defined(_WIN32)
+      c = __atomic_fetch_add(&nt->next_chunk, 1, __ATOMIC_RELAXED);
+   #else
+      c = nt->next_chunk++;
+   #endif
+
+      if (c >= nt->n_chunks)
+         break;
+
+      lo = nt->start + c * nt->step;
+      hi = (nt->limit - lo < nt->step) ? nt->limit : lo + nt->step - 1;
+
+      err = (wheel == 30)
+         ? wheel_chunk(lo, hi, nt->run_mode, fd, &n)
+         : sieve_chunk(lo, hi, nt->run_mode, fd, &n);
+      a->n_ret += n;
+
+   #if !defined(_WIN32)
+      if (a->mem_fd >= 0) {
+         // Wait for this chunk's turn. Ordered output is sent while
+         // holding the lock; positional output only takes its offset.
+         size = mem_output_size(a->mem_fd), off = -1;
+
+         pthread_mutex_lock(&nt->lock);
+
+         while (nt->next_out != c)
+            pthread_cond_wait(&nt->turn, &nt->lock);
+
+         if (err || nt->err)
+            nt->err = -1;
+         else if (nt->positional)
+            off = nt->out_off, nt->out_off += size;
+         else if (mem_output_send(a->mem_fd, nt->fd) < 0)
+            nt->err = -1;
+
+         nt->next_out++, err = nt->err;
+
+         pthread_cond_broadcast(&nt->turn);
+         pthread_mutex_unlock(&nt->lock);
+
+         if (off >= 0 && mem_output_pwrite(a->mem_fd, nt->fd, off) < 0) {
+            pthread_mutex_lock(&nt->lock);
+            nt->err = err = -1;
+            pthread_mutex_unlock(&nt->lock);
+         }
+      }
+   #endif
+
+      if (err) {
+         if (a->mem_fd < 0) nt->err = -1;
+         break;
+      }
+   }
+
+   if (stats_on) {
+      a->t_end = stats_clock();
+      memcpy(a->stats, stats_ns, sizeof(stats_ns));
+      a->stats[STAT_PHASES] = stats_blocks;
+      a->stats[STAT_PHASES + 1] = stats_chunks;
+      a->stats[STAT_PHASES + 2] = a->t_end - t_begin;
+      stats_reset();
+   }
+
+   practicalsieve_release();
+
+   return NULL;
+}
+
+// Count, sum, or print [start, limit] in chunks of step_size using native
+// threads. For print mode, the output goes to fd in order, or written by
+// offset if positional (fd is a regular file). With numa, threads are
+// pinned to cores across the nodes; the calling thread is unpinned after.
+// Stores the aggregate in n_ptr and returns the error status.
+
+static int native_run(
+      uint64_t start, uint64_t limit, uint64_t step, int run_mode, int fd,
+      int positional, int numa, int n_threads, sum_t *n_ptr )
+{
+   native_t     nt;
+   native_arg_t *args;
+   sum_t        n_ret;
+   int          i;
+
+   memset(&nt, 0, sizeof(nt));
+
+   nt.start = start, nt.limit = limit, nt.step = step;
+   nt.n_chunks = (nt.limit - nt.start) / nt.step + 1;
+   nt.run_mode = run_mode, nt.fd = fd, nt.positional = positional;
+   nt.numa = numa;
+
+   if (n_threads > nt.n_chunks) n_threads = nt.n_chunks;
+   if (n_threads < 1) n_threads = 1;
+
+   args = (native_arg_t *) calloc(n_threads, sizeof(native_arg_t));
+
+   for (i = 0; i < n_threads; i++)
+      args[i].nt = &nt, args[i].mem_fd = -1, args[i].id = i + 1;
+
+   // Print mode requires a memory file per thread; otherwise, one thread
+   // writes the chunks directly in order.
+   if (run_mode == MODE_PRINT) {
+      for (i = 0; i < n_threads; i++) {
+         if ((args[i].mem_fd = mem_output_open()) < 0) {
+            while (i > 0) mem_output_close(args[--i].mem_fd);
+            args[0].mem_fd = -1, nt.positional = 0, n_threads = 1;
+            break;
+         }
+      }
+   }
+
+   if (numa) {
+      practicalsieve_numa_init();
+      numa_save();
+   }
+
+#if !defined(_WIN32)
+   pthread_mutex_init(&nt.lock, NULL);
+   pthread_cond_init(&nt.turn, NULL);
+
+   if (n_threads > 1) {
+      pthread_t *tids = (pthread_t *) malloc(sizeof(pthread_t) * n_threads);
+      int n_started;
+
+      // If a thread fails to start, the others take its share.
+      for (i = 1; i < n_threads; i++)
+         if (pthread_create(&tids[i], NULL, native_worker, &args[i]))
+            break;
+
+      n_started = i;
+      native_worker(&args[0]);
+
+      for (i = 1; i < n_started; i++)
+         pthread_join(tids[i], NULL);
+
+      free((void *) tids);
+   }
+   else {
+      native_worker(&args[0]);
+   }
+
+   pthread_cond_destroy(&nt.turn);
+   pthread_mutex_destroy(&nt.lock);
+#else
+   native_worker(&args[0]);
+#endif
+
+   if (numa)
+      numa_restore();
+
+   for (i = 0, n_ret = 0; i < n_threads; i++) {
+      n_ret += args[i].n_ret;
+      mem_output_close(args[i].mem_fd);
+   }
+
+   // Keep a row of timers per thread, with the tail time until the run
+   // ended, for practicalsieve_stats.
+   if (stats_on) {
+      uint64_t t_end = stats_clock();
+
+      free((void *) native_rows);
+      native_rows = (uint64_t *)
+         malloc(sizeof(uint64_t) * STAT_ROW * n_threads);
+      native_n_rows = (native_rows != NULL) ? n_threads : 0;
+
+      for (i = 0; i < native_n_rows; i++) {
+         args[i].stats[STAT_PHASES + 3] =
+            args[i].t_end ? t_end - args[i].t_end : 0;
+         memcpy(native_rows + i * STAT_ROW, args[i].stats,
+            sizeof(uint64_t) * STAT_ROW);
+      }
+   }
+
+   free((void *) args);
+
+   *n_ptr = n_ret;
+
+   return nt.err;
+}
+
+// Returns the aggregate, and for print mode the error status followed by
+// the number of primes.
+
+SV* practicalsieve_parallel(
+      SV *start_sv, SV *limit_sv, SV *step_sv, int run_mode, int fd,
+      int positional, int numa, int n_threads )
+{
+   uint64_t start, limit, step;
+   sum_t    n_ret;
+   SV       *ret;
+   int      err;
+
+   #ifdef __LP64__
+      start = SvUV(start_sv);
+      limit = SvUV(limit_sv);
+      step  = SvUV(step_sv);
+   #else
+      start = strtoull(SvPV_nolen(start_sv), NULL, 10);
+      limit = strtoull(SvPV_nolen(limit_sv), NULL, 10);
+      step  = strtoull(SvPV_nolen(step_sv), NULL, 10);
+   #endif
+
+   err = native_run(start, limit, step, run_mode, fd, positional, numa,
+      n_threads, &n_ret);
+
+   ret = sieve_result(run_mode, n_ret, err);
+
+   if (run_mode == MODE_PRINT)
+      av_push((AV *) SvRV(ret), newSVuv((uint64_t) n_ret));
+
+   return ret;
+}
+
+// Process one block, at most sieve_sz numbers.
+
+SV* practicalsieve(SV *start_sv, SV *limit_sv, int run_mode, int fd)
+{
+   return practicalsieve_chunk(start_sv, limit_sv, run_mode, fd);
+}
+
+
+//#############################################################################
+// ----------------------------------------------------------------------------
+// Index of cumulative counts and sums at fixed strides. A query takes the
+// nearest entry to each end and sieves only the numbers in between, by the
+// mod-30 wheel using native threads.
+//
+//#############################################################################
+
+static index_entry_t *idx_e;
+static uint64_t idx_stride, idx_n, idx_cap;
+
+// Parse a count or sum, given as an integer or a decimal string.
+
+static sum_t parse_sum(SV *sv)
+{
+   const char *p = SvPV_nolen(sv);
+   sum_t n = 0;
+
+   for (; *p >= '0' && *p <= '9'; p++)
+      n = n * 10 + (*p - '0');
+
+   return n;
+}
+
+void index_free()
+{
+   free((void *) idx_e);
+   idx_e = NULL, idx_stride = idx_n = idx_cap = 0;
+}
+
+// Start an empty index with the given stride.
+
+void index_new(SV *stride_sv)
+{
+   index_free();
+   idx_stride = (uint64_t) parse_sum(stride_sv);
+}
+
+// Load the index file. Returns the stride and number of entries, or a
+// stride of 0 if the file is missing or invalid.
+
+SV* index_load(char *path)
+{
+   AV *ret = newAV();
+   index_hdr_t hdr;
+   FILE *fp;
+   int  ok = 0;
+
+   index_free();
+
+   if ((fp = fopen(path, "rb")) != NULL) {
+      if (fread(&hdr, sizeof(hdr), 1, fp) == 1 &&
+            !memcmp(hdr.magic, INDEX_MAGIC, 8) &&
+            hdr.version == INDEX_VERSION && hdr.hdr_sz == sizeof(hdr) &&
+            hdr.stride > 0 && hdr.sum_bits == SUM_BITS) {
+         idx_cap = (hdr.n_entries > 0) ? hdr.n_entries : 1;
+         idx_e = (index_entry_t *) malloc(sizeof(index_entry_t) * idx_cap);
+
+         if (idx_e != NULL && fread(idx_e, sizeof(index_entry_t),
+               hdr.n_entries, fp) == hdr.n_entries) {
+            idx_stride = hdr.stride, idx_n = hdr.n_entries, ok = 1;
+         }
+      }
+      fclose(fp);
+   }
+
+   if (!ok)
+      index_free();
+
+   av_push(ret, sum_sv((sum_t) idx_stride));
+   av_push(ret, sum_sv((sum_t) idx_n));
+
+   return newRV_noinc((SV *) ret);
+}
+
+// Append the count and sum of primes in the next stride.
+
+void index_append(SV *count_sv, SV *sum_sv)
+{
+   index_entry_t *e;
+   sum_t sum;
+
+   if (idx_n == idx_cap) {
+      idx_cap = (idx_cap > 0) ? idx_cap * 2 : 1024;
+      idx_e = (index_entry_t *)
+         realloc(idx_e, sizeof(index_entry_t) * idx_cap);
+   }
+
+   e = idx_e + idx_n, sum = parse_sum(sum_sv);
+
+   if (idx_n > 0) {
+      e->count = e[-1].count;
+   #if SUM_BITS > 64
+      sum += (sum_t) e[-1].sum_hi << 64 | e[-1].sum_lo;
+   #else
+      sum += e[-1].sum_lo;
+   #endif
+   }
+   else {
+      e->count = 0;
+   }
+
+   e->count += (uint64_t) parse_sum(count_sv);
+   e->sum_lo = (uint64_t) sum;
+#if SUM_BITS > 64
+   e->sum_hi = (uint64_t) (sum >> 64);
+#else
+   e->sum_hi = 0;
+#endif
+
+   idx_n++;
+}
+
+// Write the index to a temporary file first, then rename it into place.
+// Returns 0 on success.
+
+int index_save(char *path)
+{
+   index_hdr_t hdr;
+   char *tmp;
+   FILE *fp;
+   int  ok = 0;
+
+   memset(&hdr, 0, sizeof(hdr));
+   memcpy(hdr.magic, INDEX_MAGIC, 8);
+
+   hdr.version = INDEX_VERSION, hdr.hdr_sz = sizeof(hdr);
+   hdr.stride = idx_stride, hdr.n_entries = idx_n, hdr.sum_bits = SUM_BITS;
+
+   tmp = (char *) malloc(strlen(path) + 24);
+   sprintf(tmp, "%s.%d", path, (int) getpid());
+
+   if ((fp = fopen(tmp, "wb")) != NULL) {
+      ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+            fwrite(idx_e, sizeof(index_entry_t), idx_n, fp) == idx_n);
+
+      if (fclose(fp)) ok = 0;
+      if (ok && rename(tmp, path)) ok = 0;
+      if (!ok) unlink(tmp);
+   }
+
+   free((void *) tmp);
+
+   return ok ? 0 : -1;
+}
+
+// Count and sum the primes in [start, limit] in one pass, for building
+// the index. Returns the count and the sum.
+
+SV* index_chunk(SV *start_sv, SV *limit_sv)
+{
+   uint64_t start, limit;
+   sum_t    n_ret;
+   SV       *ret;
+
+   #ifdef __LP64__
+      start = SvUV(start_sv);
+      limit = SvUV(limit_sv);
+   #else
+      start = strtoull(SvPV_nolen(start_sv), NULL, 10);
+      limit = strtoull(SvPV_nolen(limit_sv), NULL, 10);
+   #endif
+
+   wheel_init();
+   wheel_chunk(start, limit, MODE_SUM, -1, &n_ret);
+
+   ret = sieve_result(MODE_COUNT, (sum_t) sum_n, 0);
+   av_push((AV *) SvRV(ret), sum_sv(n_ret));
+
+   return ret;
+}
+
+// Count or sum [lo, hi] by the wheel engine, in a few chunks per thread.
+
+static sum_t index_sieve(
+      uint64_t lo, uint64_t hi, int run_mode, int n_threads, int *err )
+{
+   uint64_t step;
+   sum_t    n;
+
+   step = (hi - lo) / (4 * n_threads) + 1;
+   if (step < SIEVE_sz) step = SIEVE_sz;
+
+   *err |= native_run(lo, hi, step, run_mode, -1, 0, 0, n_threads, &n);
+
+   return n;
+}
+
+// The count or sum through x: from the entry at or below x plus the
+// numbers after it, or from the entry above x less the numbers up to it,
+// whichever sieves less. Past the last entry, sieve from there.
+
+static sum_t index_cum(uint64_t x, int run_mode, int n_threads, int *err)
+{
+   uint64_t k, r, lo, hi;
+   sum_t    base, n;
+   int      above;
+
+   if (x == 0)
+      return 0;
+
+   k = x / idx_stride, r = x - k * idx_stride;
+
+   if (k > idx_n)
+      k = idx_n, r = x - k * idx_stride;
+
+   above = (k < idx_n && r > idx_stride / 2);
+
+   if (above)
+      k++, lo = x + 1, hi = k * idx_stride;
+   else
+      lo = x - r + 1, hi = x;
+
+   if (k == 0)
+      base = 0;
+   else if (run_mode == MODE_SUM)
+   #if SUM_BITS > 64
+      base = (sum_t) idx_e[k - 1].sum_hi << 64 | idx_e[k - 1].sum_lo;
+   #else
+      base = idx_e[k - 1].sum_lo;
+   #endif
+   else
+      base = idx_e[k - 1].count;
+
+   if (lo > hi)
+      return base;
+
+   n = index_sieve(lo, hi, run_mode, n_threads, err);
+
+   return above ? base - n : base + n;
+}
+
+// Count or sum [from, to] from the index, sieving the ends, or only the
+// range itself if it begins past the last entry. Requires
+// practicalsieve_precalc through the entry above to, if any.
+
+SV* index_query(SV *from_sv, SV *to_sv, int run_mode, int n_threads)
+{
+   uint64_t from, to;
+   sum_t    n_ret;
+   int      err = 0, w = wheel;
+
+   #ifdef __LP64__
+      from = SvUV(from_sv);
+      to   = SvUV(to_sv);
+   #else
+      from = strtoull(SvPV_nolen(from_sv), NULL, 10);
+      to   = strtoull(SvPV_nolen(to_sv), NULL, 10);
+   #endif
+
+   if (n_threads < 1) n_threads = 1;
+
+   // The ends begin anywhere, which only the wheel engine allows.
+   wheel_init(), wheel = 30;
+
+   if (from - 1 >= idx_n * idx_stride) {
+      n_ret = (from <= to)
+         ? index_sieve(from, to, run_mode, n_threads, &err) : 0;
+   }
+   else {
+      n_ret  = index_cum(to, run_mode, n_threads, &err);
+      n_ret -= index_cum(from - 1, run_mode, n_threads, &err);
+   }
+
+   wheel = w;
+
+   return sieve_result(run_mode, n_ret, err);
+}
+
+//#############################################################################
+// ----------------------------------------------------------------------------
+// Prime counting (Lagarias, Miller, Odlyzko). With y >= x^(1/3), z = x / y,
+// and a = pi(y):
+//
+//   pi(x) = phi(x, a) + a - 1 - P2
+//   phi(x, a) = S1 + S2, the ordinary and special leaves
+//
+//   S1 = sum mu(n) * floor(x / n), for n <= y
+//   S2 = -sum mu(m) * phi(x / (p_b * m), b - 1), for b < a and m <= y,
+//        where y / p_b < m and the least prime factor of m exceeds p_b
+//   P2 = sum pi(x / p) - pi(p) + 1, for primes y < p <= sqrt(x)
+//
+// The special leaves and P2 only need counts up to z. Workers sieve [1, z]
+// in chunks, with counts relative to the chunk start. The manager merges
+// the chunks in order (primecount_merge), adding the counts before each
+// chunk. The sums wrap modulo 2^64, which cancels out for pi(x) < 2^64.
+//
+//#############################################################################
+
+// Odd numbers per segment of the leaves sieve, and bits per counter used
+// to count the unsieved numbers below a leaf.
+
+#define PC_SEG_BITS 262144
+#define PC_SEG_N    (2 * (uint64_t) PC_SEG_BITS)
+#define PC_CTR_BITS 512
+#define PC_SMALL    100000
+
+typedef struct {
+   uint64_t x, y, z, sqrt_x, pi_x;
+   uint64_t s, p2, n_before;
+   int64_t  a, b_sqrt;
+   uint32_t *primes;
+   int32_t  *lpf_mu;
+   uint64_t *phi_before;
+} pcount_t;
+
+static pcount_t PC;
+
+static uint64_t pc_isqrt(uint64_t n)
+{
+   uint64_t r = (uint64_t) sqrt((double) n);
+
+   if (r > UINT32_MAX) r = UINT32_MAX;
+   while (r > 0 && r * r > n) r--;
+   while (r < UINT32_MAX && (r + 1) * (r + 1) <= n) r++;
+
+   return r;
+}
+
+static uint64_t pc_icbrt(uint64_t n)
+{
+   uint64_t r = (uint64_t) cbrt((double) n);
+
+   // 2642245 is the cube root of 2^64, rounded down.
+   if (r > 2642245) r = 2642245;
+   while (r > 0 && r * r * r > n) r--;
+   while (r < 2642245 && (r + 1) * (r + 1) * (r + 1) <= n) r++;
+
+   return r;
+}
+
+// Number of primes <= s, counted from is_prime.
+
+static uint64_t pc_pi_small(uint64_t s)
+{
+   int64_t i, n, m;
+
+   if (s < 5)
+      return (s >= 3) ? 2 : (s == 2);
+
+   i = s / 3;
+   if (3 * i + 1 + (i & 1) > s) i--;
+
+   m = (i + 1) / 8;
+   n = popcount(is_prime, m);
+
+   for (m *= 8; m <= i; m++)
+      if (ISBITSET(is_prime, m)) n++;
+
+   // Bit 0 (the number 1) is not a prime.
+   if (ISBITSET(is_prime, 0)) n--;
+
+   return 2 + n;
+}
+
+// Count the unsieved numbers <= v in the segment, whose first bit is the
+// odd number o. Called with increasing v, resuming from *blk and *acc.
+
+static uint64_t pc_count(
+      const uint64_t *bits, const uint32_t *ctr, uint64_t o, uint64_t v,
+      int64_t *blk, uint64_t *acc )
+{
+   uint64_t c, k, w;
+
+   if (v < o)
+      return 0;
+
+   k = (v - o) / 2;
+
+   while ((uint64_t) (*blk + 1) * PC_CTR_BITS <= k)
+      *acc += ctr[(*blk)++];
+
+   c = *acc;
+
+   for (w = *blk * (PC_CTR_BITS / 64); w < k >> 6; w++)
+      c += POPCNT64(bits[w]);
+
+   return c + POPCNT64(bits[k >> 6] & (~0ULL >> (63 - (k & 63))));
+}
+
+// Process [lo, hi] of the leaves sieve. The output is the chunk's S2 and
+// P2 relative to lo, the number of P2 primes, the number of primes in the
+// chunk, then per b the sum of -mu(m) over its leaves, and phi(.., b - 1)
+// counted over the chunk.
+
+static void pc_chunk(uint64_t lo, uint64_t hi, uint64_t *out)
+{
+   uint64_t x, y, low, high, o, p, n, m, v, k, mmin, cnt, acc, p_lo, p_hi;
+   uint64_t s2, p2, n_p, n_primes, total, *bits, *next, *mcur, *mus, *phi;
+   uint32_t *ctr;
+   int64_t  a, b, b_max, extra, n_bits, n_words, blk, i;
+   int32_t  lm;
+
+   x = PC.x, y = PC.y, a = PC.a;
+   mus = out + 4, phi = out + 4 + (a + 1);
+
+   bits = (uint64_t *) malloc(PC_SEG_BITS / 8);
+   ctr  = (uint32_t *) malloc(sizeof(uint32_t) * (PC_SEG_BITS / PC_CTR_BITS));
+   next = (uint64_t *) malloc(sizeof(uint64_t) * (a + 1));
+   mcur = (uint64_t *) malloc(sizeof(uint64_t) * (a + 1));
+
+   // The leaves use b < a; sieving reaches sqrt(hi), at most p_a.
+   p = PC.primes[a];
+   b_max = (p * p <= hi) ? a : a - 1;
+
+   for (b = 2; b <= b_max; b++) {
+      p = PC.primes[b], n = (lo + p - 1) / p * p;
+      next[b] = (n & 1) ? n : n + p;
+      if (b < a) mcur[b] = (x / (p * lo) < y) ? x / (p * lo) : y;
+   }
+
+   s2 = 0, p2 = 0, n_p = 0, n_primes = 0;
+
+   for (low = lo; ; low += PC_SEG_N) {
+      high = (hi - low < PC_SEG_N) ? hi : low + PC_SEG_N - 1;
+
+      //=================================================================
+      // Odd numbers only; the multiples of 2 (b = 1) are gone already.
+      //=================================================================
+
+      o = low | 1;
+      n_bits = (high >= o) ? (high - o) / 2 + 1 : 0;
+      n_words = (n_bits + 63) / 64;
+
+      memset(bits, 0xff, n_words * 8);
+
+      if (n_bits & 63)
+         bits[n_words - 1] = (1ULL << (n_bits & 63)) - 1;
+
+      for (i = 0; i * PC_CTR_BITS < n_bits; i++)
+         ctr[i] = (n_bits - i * PC_CTR_BITS < PC_CTR_BITS)
+            ? n_bits - i * PC_CTR_BITS : PC_CTR_BITS;
+
+      total = n_bits;
+
+      for (b = 2; b <= b_max; b++) {
+         p = PC.primes[b];
+
+         // Leaves x / (p * m) in this segment, with increasing v.
+         if (b < a) {
+            m = mcur[b], mmin = y / p;
+
+            if (m > mmin && (v = x / (p * m)) <= high) {
+               blk = 0, acc = 0;
+
+               do {
+                  lm = PC.lpf_mu[m];
+
+                  if (lm > 0 && (uint64_t) lm > p) {
+                     cnt = phi[b] + pc_count(bits, ctr, o, v, &blk, &acc);
+                     s2 -= cnt, mus[b]--;
+                  }
+                  else if (lm < 0 && (uint64_t) -lm > p) {
+                     cnt = phi[b] + pc_count(bits, ctr, o, v, &blk, &acc);
+                     s2 += cnt, mus[b]++;
+                  }
+               } while (--m > mmin && (v = x / (p * m)) <= high);
+
+               mcur[b] = m;
+            }
+
+            phi[b] += total;
+         }
+
+         // Remove the odd multiples of p, including p.
+         for (n = next[b]; n <= high; n += 2 * p) {
+            k = (n - o) / 2;
+
+            if (bits[k >> 6] >> (k & 63) & 1) {
+               bits[k >> 6] &= ~(1ULL << (k & 63));
+               total--, ctr[k / PC_CTR_BITS]--;
+            }
+         }
+
+         next[b] = n;
+      }
+
+      //=================================================================
+      // The unsieved numbers are now 1 and the primes > sqrt(high).
+      // Adjust for 1, 2, and the sieving primes inside the segment.
+      //=================================================================
+
+      extra = (low <= 2 && 2 <= high) - (low <= 1);
+
+      for (b = 2; b <= b_max && PC.primes[b] <= high; b++)
+         if (PC.primes[b] >= low) extra++;
+
+      // P2 primes y < p <= sqrt(x), where x / p is in this segment.
+      p_hi = (x / low < PC.sqrt_x) ? x / low : PC.sqrt_x;
+      p_lo = (x / (high + 1) > y) ? x / (high + 1) : y;
+
+      if (p_hi > p_lo) {
+         i = p_hi / 3, blk = 0, acc = 0;
+         if (3 * i + 1 + (i & 1) > p_hi) i--;
+
+         for (; (p = 3 * i + 1 + (i & 1)) > p_lo; i--) {
+            if (ISBITSET(is_prime, i)) {
+               v = x / p;
+               p2 += n_primes + extra + pc_count(bits, ctr, o, v, &blk, &acc);
+               n_p++;
+            }
+         }
+      }
+
+      n_primes += total + extra;
+
+      if (high == hi)
+         break;
+   }
+
+   out[0] = s2, out[1] = p2, out[2] = n_p, out[3] = n_primes;
+
+   free((void *) mcur);
+   free((void *) next);
+   free((void *) ctr);
+   free((void *) bits);
+}
+
+// Release the state of the prime counting function.
+
+void primecount_free()
+{
+   free((void *) PC.primes);
+   free((void *) PC.lpf_mu);
+   free((void *) PC.phi_before);
+
+   memset(&PC, 0, sizeof(PC));
+}
+
+// Set up pi(x), after practicalsieve_precalc for a NUMBER >= x. Computes
+// the ordinary leaves and the special leaves for b = 1, phi(v, 0) = v.
+// Returns z, the limit of the leaves sieve; 0 if pi(x) is known already.
+
+SV* primecount_init(SV *x_sv)
+{
+   uint64_t x, y, n, p, s;
+   uint32_t *lpf;
+   int64_t  a, i;
+   int8_t   *mu;
+
+   #ifdef __LP64__
+      x = SvUV(x_sv);
+   #else
+      x = strtoull(SvPV_nolen(x_sv), NULL, 10);
+   #endif
+
+   primecount_free();
+   PC.x = x, PC.sqrt_x = pc_isqrt(x);
+
+   if (PC.sqrt_x / 3 > (uint64_t) SP_max) {
+      fprintf(stderr, "error: primecount_init requires precalc up to x\n");
+      exit(2);
+   }
+
+   if (x < PC_SMALL) {
+      byte_t *c = (byte_t *) calloc(x + 1, 1);
+
+      for (n = 2; n <= x; n++) {
+         if (c[n]) continue;
+         PC.pi_x++;
+         for (p = n * n; p <= x; p += n) c[p] = 1;
+      }
+
+      free((void *) c);
+
+      return newSVuv(0);
+   }
+
+   //====================================================================
+   // The primes, least prime factors and Moebius values up to y.
+   //====================================================================
+
+   y = pc_icbrt(x) + 1;
+   if (y > PC.sqrt_x) y = PC.sqrt_x;
+   a = pc_pi_small(y);
+
+   PC.y = y, PC.z = x / y, PC.a = a, PC.b_sqrt = pc_pi_small(PC.sqrt_x);
+   PC.primes = (uint32_t *) malloc(sizeof(uint32_t) * (a + 1));
+   PC.primes[0] = 0, PC.primes[1] = 2, PC.primes[2] = 3;
+
+   for (i = 1, n = 2; n < a; i++) {
+      if (ISBITSET(is_prime, i))
+         PC.primes[++n] = 3 * i + 1 + (i & 1);
+   }
+
+   lpf = (uint32_t *) calloc(y + 1, sizeof(uint32_t));
+   mu  = (int8_t *) malloc(y + 1);
+   memset(mu, 1, y + 1);
+
+   for (i = 1; i <= a; i++) {
+      p = PC.primes[i];
+
+      for (n = p; n <= y; n += p) {
+         if (!lpf[n]) lpf[n] = p;
+         mu[n] = -mu[n];
+      }
+      for (n = p * p; n <= y; n += p * p)
+         mu[n] = 0;
+   }
+
+   PC.lpf_mu = (int32_t *) malloc(sizeof(int32_t) * (y + 1));
+   PC.lpf_mu[0] = 0, PC.lpf_mu[1] = INT32_MAX;
+
+   for (n = 2; n <= y; n++)
+      PC.lpf_mu[n] = mu[n] * (int32_t) lpf[n];
+
+   free((void *) mu);
+   free((void *) lpf);
+
+   //====================================================================
+   // Ordinary leaves, and the special leaves for b = 1 (odd m > y / 2).
+   //====================================================================
+
+   for (n = 1, s = 0; n <= y; n++) {
+      if (PC.lpf_mu[n] > 0) s += x / n;
+      if (PC.lpf_mu[n] < 0) s -= x / n;
+   }
+
+   for (n = y / 2 + 1; n <= y; n++) {
+      if (!(n & 1)) continue;
+      if (PC.lpf_mu[n] > 0) s -= x / (2 * n);
+      if (PC.lpf_mu[n] < 0) s += x / (2 * n);
+   }
+
+   PC.s = s;
+   PC.phi_before = (uint64_t *) calloc(a + 1, sizeof(uint64_t));
+
+   #ifdef __LP64__
+      return newSVuv(PC.z);
+   #else
+   {
+      char buf[N_MAXDIGITS + 1];
+      return newSVpvn(buf, sprintull(buf, PC.z));
+   }
+   #endif
+}
+
+// Sieve the chunk [lo, hi] of [1, z], returning the result packed.
+
+SV* primecount_chunk(SV *lo_sv, SV *hi_sv)
+{
+   uint64_t lo, hi, *out;
+   size_t   size;
+   SV       *ret;
+
+   #ifdef __LP64__
+      lo = SvUV(lo_sv);
+      hi = SvUV(hi_sv);
+   #else
+      lo = strtoull(SvPV_nolen(lo_sv), NULL, 10);
+      hi = strtoull(SvPV_nolen(hi_sv), NULL, 10);
+   #endif
+
+   size = sizeof(uint64_t) * (4 + 2 * (PC.a + 1));
+   out  = (uint64_t *) calloc(1, size);
+
+   pc_chunk(lo, hi, out);
+
+   ret = newSVpvn((char *) out, size);
+   free((void *) out);
+
+   return ret;
+}
+
+// Merge the next chunk in order, adding the counts before the chunk.
+
+void primecount_merge(SV *res_sv)
+{
+   uint64_t *r, *mus, *phi;
+   STRLEN   len;
+   char     *buf;
+   int64_t  b;
+
+   buf = SvPV(res_sv, len);
+
+   if (len != sizeof(uint64_t) * (4 + 2 * (PC.a + 1)))
+      return;
+
+   r = (uint64_t *) malloc(len);
+   memcpy(r, buf, len);
+
+   mus = r + 4, phi = r + 4 + (PC.a + 1);
+
+   for (b = 2; b < PC.a; b++) {
+      PC.s += mus[b] * PC.phi_before[b];
+      PC.phi_before[b] += phi[b];
+   }
+
+   PC.s  += r[0];
+   PC.p2 += r[1] + r[2] * PC.n_before;
+   PC.n_before += r[3];
+
+   free((void *) r);
+}
+
+// Return pi(x), once all chunks are merged.
+
+SV* primecount_result()
+{
+   uint64_t a, b, pi, offset = 0;
+
+   if (PC.z == 0) {
+      pi = PC.pi_x;
+   }
+   else {
+      // P2 subtracts pi(p) - 1 = b - 1 for each b in (a, pi(sqrt(x))].
+      a = PC.a, b = PC.b_sqrt;
+      if (b > a) offset = (b - 1) * b / 2 - (a - 1) * a / 2;
+      pi = PC.s + a - 1 - (PC.p2 - offset);
+   }
+
+   return sieve_result(MODE_COUNT, pi, 0);
+}
@@ -0,0 +1,117 @@
+#line 2 "../src/arena.h"
+//#############################################################################
+// ----------------------------------------------------------------------------
+// C helper functions for reusable per-thread buffers.
+//
+//#############################################################################
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+// Buffers used for every block are taken from an arena, one per thread
+// (hence one per worker), and kept until arena_release. A slot grows when
+// asked for more; its contents are not preserved. Slots of 2 MiB or more
+// are mapped, preferring huge pages, so the pages are faulted in once per
+// worker rather than on every block.
+
+#define ARENA_SLOTS   6
+#define ARENA_HUGE_SZ (2 * 1024 * 1024)
+
+enum {
+   ARENA_SIEVE = 0, ARENA_PRINT, ARENA_BATCH, ARENA_SPRIME, ARENA_HEADS,
+   ARENA_CARRY
+};
+
+typedef struct {
+   void   *ptr;
+   size_t size;
+   int    mapped;
+} arena_slot_t;
+
+static THREAD_LOCAL arena_slot_t arena[ARENA_SLOTS];
+
+static void arena_slot_free(arena_slot_t *s)
+{
+   if (s->ptr == NULL)
+      return;
+
+#if !defined(_WIN32)
+   if (s->mapped)
+      munmap(s->ptr, s->size);
+   else
+#endif
+      free(s->ptr);
+
+   s->ptr = NULL, s->size = 0, s->mapped = 0;
+}
+
+static void *arena_get(int slot, size_t size)
+{
+   arena_slot_t *s = &arena[slot];
+   void *ptr = NULL;
+
+   if (s->ptr != NULL && s->size >= size)
+      return s->ptr;
+
+   arena_slot_free(s);
+
+#if !defined(_WIN32)
+   if (size >= ARENA_HUGE_SZ) {
+      size = (size + ARENA_HUGE_SZ - 1) & ~((size_t) ARENA_HUGE_SZ - 1);
+
+   #if defined(MAP_HUGETLB)
+      ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (ptr == MAP_FAILED) ptr = NULL;
+   #endif
+
+      if (ptr == NULL) {
+         ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+         if (ptr == MAP_FAILED) ptr = NULL;
+
+      #if defined(MADV_HUGEPAGE)
+         if (ptr != NULL) madvise(ptr, size, MADV_HUGEPAGE);
+      #endif
+      }
+
+      if (ptr != NULL) {
+         s->ptr = ptr, s->size = size, s->mapped = 1;
+         return ptr;
+      }
+   }
+#endif
+
+   if ((ptr = malloc(size)) != NULL)
+      s->ptr = ptr, s->size = size;
+
+   return ptr;
+}
+
+static void arena_release(void)
+{
+   int i;
+
+   for (i = 0; i < ARENA_SLOTS; i++)
+      arena_slot_free(&arena[i]);
+}
+
+#endif
+
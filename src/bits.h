@@ -9,6 +9,7 @@
 #define BITS_H
 
 #include <stdint.h>
+#include <string.h>
 
 typedef unsigned char byte_t;
 
@@ -32,10 +33,76 @@ static const int unset_bit[8] = {
 #define ISBITSET(s, i) s[(int64_t) (i) >> 3] &  (1 << ((i) & 7))
 #define SETBIT(s, i)   s[(int64_t) (i) >> 3] |= (1 << ((i) & 7))
 
+// Load 8 bytes of a byte array as a 64-bit word, bit i of the word being
+// bit (i & 7) of byte (i >> 3), regardless of the host byte order.
+
+static uint64_t load_word(const byte_t *bytearray)
+{
+   uint64_t w;
+
+   memcpy(&w, bytearray, 8);
+
+   #if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      w = __builtin_bswap64(w);
+   #endif
+
+   return w;
+}
+
+// Kernel bodies are forced inline into each ISA variant of a kernel, so
+// every copy is compiled for the target of its variant.
+
+#if defined(__GNUC__)
+#define KERNEL_INLINE static __inline__ __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define KERNEL_INLINE static __forceinline
+#else
+#define KERNEL_INLINE static
+#endif
+
+// Index of the lowest set bit in a non-zero word.
+
+#if defined(__GNUC__)
+#define CTZ64(w) __builtin_ctzll(w)
+
+#elif defined(_MSC_VER) && defined(_WIN64)
+#include <intrin.h>
+
+static int CTZ64(uint64_t w)
+{
+   unsigned long i; _BitScanForward64(&i, w);
+   return (int) i;
+}
+
+#else
+static int CTZ64(uint64_t w)
+{
+   int i = 0;
+   while (!(w & 1)) w >>= 1, i++;
+   return i;
+}
+
+#endif
+
+// Number of set bits in a word.
+
+#if defined(__GNUC__)
+#define POPCNT64(w) __builtin_popcountll(w)
+
+#else
+static int POPCNT64(uint64_t w)
+{
+   int n = 0;
+   while (w) n += popcnt_byte[w & 0xff], w >>= 8;
+   return n;
+}
+
+#endif
+
 // I received help for the following by reading popcount.cpp from
 // primesieve.org and util.c (popcnt) from Math::Prime::Util.
 
-static uint64_t popcount(const byte_t *bytearray, uint64_t size)
+static uint64_t popcount_default(const byte_t *bytearray, uint64_t size)
 {
    uint64_t asize, i, count = 0;
 
@@ -94,5 +161,201 @@ static uint64_t popcount(const byte_t *bytearray, uint64_t size)
    return count;
 }
 
+// Hardware kernels, chosen at runtime on the first call. The Inline::C
+// build has no -march flag, so each kernel enables its own ISA through
+// the target attribute. On x86, the order of preference is AVX-512
+// VPOPCNTDQ, AVX2 (Harley-Seal), then the POPCNT instruction.
+
+#if defined(__GNUC__) && defined(__x86_64__) && \
+    (defined(__clang__) || __GNUC__ >= 8)
+
+#define POPCOUNT_X86 1
+
+#include <immintrin.h>
+
+__attribute__((target("popcnt")))
+static uint64_t popcount_popcnt(const byte_t *bytearray, uint64_t size)
+{
+   uint64_t i, w, count = 0;
+
+   for (i = 0; i + 8 <= size; i += 8) {
+      memcpy(&w, bytearray + i, 8);
+      count += __builtin_popcountll(w);
+   }
+
+   for (; i < size; i++)
+      count += popcnt_byte[bytearray[i]];
+
+   return count;
+}
+
+// Harley-Seal with carry-save adders, from "Faster Population Counts
+// Using AVX2 Instructions" (Mula, Kurz, Lemire).
+
+#define CSA256(h, l, a, b, c) { \
+   __m256i u = _mm256_xor_si256(a, b); \
+   h = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c)); \
+   l = _mm256_xor_si256(u, c); \
+}
+
+__attribute__((target("avx2")))
+static __m256i popcount256(__m256i v)
+{
+   const __m256i lookup = _mm256_setr_epi8(
+      0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4, 0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4
+   );
+   const __m256i low_mask = _mm256_set1_epi8(0x0f);
+
+   __m256i lo = _mm256_and_si256(v, low_mask);
+   __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+   __m256i cnt = _mm256_add_epi8(
+      _mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi)
+   );
+
+   return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2,popcnt")))
+static uint64_t popcount_avx2(const byte_t *bytearray, uint64_t size)
+{
+   const __m256i *p = (const __m256i *) bytearray;
+   __m256i total = _mm256_setzero_si256();
+   __m256i ones  = _mm256_setzero_si256();
+   __m256i twos  = _mm256_setzero_si256();
+   __m256i fours = _mm256_setzero_si256();
+   __m256i eights = _mm256_setzero_si256();
+   __m256i sixteens, twos_a, twos_b, fours_a, fours_b, eights_a, eights_b;
+   uint64_t i, n = size / 32, count;
+
+   for (i = 0; i + 16 <= n; i += 16, p += 16) {
+      CSA256(twos_a, ones, ones,
+         _mm256_loadu_si256(p + 0), _mm256_loadu_si256(p + 1));
+      CSA256(twos_b, ones, ones,
+         _mm256_loadu_si256(p + 2), _mm256_loadu_si256(p + 3));
+      CSA256(fours_a, twos, twos, twos_a, twos_b);
+      CSA256(twos_a, ones, ones,
+         _mm256_loadu_si256(p + 4), _mm256_loadu_si256(p + 5));
+      CSA256(twos_b, ones, ones,
+         _mm256_loadu_si256(p + 6), _mm256_loadu_si256(p + 7));
+      CSA256(fours_b, twos, twos, twos_a, twos_b);
+      CSA256(eights_a, fours, fours, fours_a, fours_b);
+      CSA256(twos_a, ones, ones,
+         _mm256_loadu_si256(p + 8), _mm256_loadu_si256(p + 9));
+      CSA256(twos_b, ones, ones,
+         _mm256_loadu_si256(p + 10), _mm256_loadu_si256(p + 11));
+      CSA256(fours_a, twos, twos, twos_a, twos_b);
+      CSA256(twos_a, ones, ones,
+         _mm256_loadu_si256(p + 12), _mm256_loadu_si256(p + 13));
+      CSA256(twos_b, ones, ones,
+         _mm256_loadu_si256(p + 14), _mm256_loadu_si256(p + 15));
+      CSA256(fours_b, twos, twos, twos_a, twos_b);
+      CSA256(eights_b, fours, fours, fours_a, fours_b);
+      CSA256(sixteens, eights, eights, eights_a, eights_b);
+
+      total = _mm256_add_epi64(total, popcount256(sixteens));
+   }
+
+   total = _mm256_slli_epi64(total, 4);
+   total = _mm256_add_epi64(total,
+      _mm256_slli_epi64(popcount256(eights), 3));
+   total = _mm256_add_epi64(total,
+      _mm256_slli_epi64(popcount256(fours), 2));
+   total = _mm256_add_epi64(total,
+      _mm256_slli_epi64(popcount256(twos), 1));
+   total = _mm256_add_epi64(total, popcount256(ones));
+
+   for (; i < n; i++, p++)
+      total = _mm256_add_epi64(total, popcount256(_mm256_loadu_si256(p)));
+
+   count  = (uint64_t) _mm256_extract_epi64(total, 0);
+   count += (uint64_t) _mm256_extract_epi64(total, 1);
+   count += (uint64_t) _mm256_extract_epi64(total, 2);
+   count += (uint64_t) _mm256_extract_epi64(total, 3);
+
+   return count + popcount_popcnt(bytearray + n * 32, size - n * 32);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static uint64_t popcount_avx512(const byte_t *bytearray, uint64_t size)
+{
+   __m512i total = _mm512_setzero_si512();
+   uint64_t i;
+
+   for (i = 0; i + 64 <= size; i += 64) {
+      __m512i v = _mm512_loadu_si512((const void *) (bytearray + i));
+      total = _mm512_add_epi64(total, _mm512_popcnt_epi64(v));
+   }
+
+   return (uint64_t) _mm512_reduce_add_epi64(total) +
+      popcount_popcnt(bytearray + i, size - i);
+}
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+
+#define POPCOUNT_NEON 1
+
+#include <arm_neon.h>
+
+// NEON is part of the AArch64 base ISA, so no runtime check is needed.
+// Byte counts are widened before they can overflow (31 * 16 * 8 bits).
+
+static uint64_t popcount_neon(const byte_t *bytearray, uint64_t size)
+{
+   uint64x2_t total = vdupq_n_u64(0);
+   uint64_t i = 0, count;
+
+   while (i + 16 <= size) {
+      uint16x8_t acc = vdupq_n_u16(0);
+      int n;
+
+      for (n = 0; n < 31 && i + 16 <= size; n++, i += 16)
+         acc = vpadalq_u8(acc, vcntq_u8(vld1q_u8(bytearray + i)));
+
+      total = vpadalq_u32(total, vpaddlq_u16(acc));
+   }
+
+   count = vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1);
+
+   for (; i < size; i++)
+      count += popcnt_byte[bytearray[i]];
+
+   return count;
+}
+
+#endif
+
+static uint64_t (*popcount_fn)(const byte_t *, uint64_t) = 0;
+
+static uint64_t popcount(const byte_t *bytearray, uint64_t size)
+{
+   if (bytearray == 0 || size == 0)
+      return 0;
+
+   if (popcount_fn == 0) {
+      #if defined(POPCOUNT_X86)
+         __builtin_cpu_init();
+
+         if (__builtin_cpu_supports("avx512vpopcntdq"))
+            popcount_fn = popcount_avx512;
+         else if (__builtin_cpu_supports("avx2") &&
+                  __builtin_cpu_supports("popcnt"))
+            popcount_fn = popcount_avx2;
+         else if (__builtin_cpu_supports("popcnt"))
+            popcount_fn = popcount_popcnt;
+         else
+            popcount_fn = popcount_default;
+
+      #elif defined(POPCOUNT_NEON)
+         popcount_fn = popcount_neon;
+
+      #else
+         popcount_fn = popcount_default;
+
+      #endif
+   }
+
+   return popcount_fn(bytearray, size);
+}
+
 #endif
 
@@ -0,0 +1,146 @@
+#line 2 "../src/numa.h"
+//#############################################################################
+// ----------------------------------------------------------------------------
+// C helper functions for NUMA topology and pinning workers to cores.
+//
+//#############################################################################
+
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#define NUMA_SYSFS "/sys/devices/system/node"
+
+#if defined(__linux__)
+
+// Read a cpulist such as "0-7,16-23" into set. Returns the number of cpus.
+
+static int numa_read_cpulist(const char *path, cpu_set_t *set)
+{
+   FILE *fp;
+   char buf[4096], *p;
+   long lo, hi;
+   int n_cpus = 0;
+
+   CPU_ZERO(set);
+
+   if ((fp = fopen(path, "r")) == NULL)
+      return 0;
+
+   if (fgets(buf, sizeof(buf), fp) == NULL)
+      buf[0] = '\0';
+
+   fclose(fp);
+
+   for (p = buf; *p >= '0' && *p <= '9'; ) {
+      lo = hi = strtol(p, &p, 10);
+
+      if (*p == '-')
+         hi = strtol(p + 1, &p, 10);
+
+      for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+         CPU_SET(lo, set), n_cpus++;
+
+      if (*p == ',') p++;
+   }
+
+   return n_cpus;
+}
+
+#endif
+
+// Return the number of NUMA nodes, 1 if unknown.
+
+static int numa_node_count(void)
+{
+   int n_nodes = 0;
+
+#if defined(__linux__)
+   char path[64];
+
+   for (;;) {
+      snprintf(path, sizeof(path), NUMA_SYSFS "/node%d", n_nodes);
+      if (access(path, F_OK) != 0) break;
+      n_nodes++;
+   }
+#endif
+
+   return (n_nodes > 0) ? n_nodes : 1;
+}
+
+// Pin the calling thread to the slot'th allowed cpu of node, wrapping
+// around if there are more slots than cpus. Falls back to all allowed
+// cpus if the node cpulist is unavailable. Returns the cpu, or -1.
+
+static int numa_pin(int node, int slot)
+{
+#if defined(__linux__)
+   cpu_set_t allowed, node_set, set;
+   char path[64];
+   int cpu, n_cpus;
+
+   if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+      return -1;
+
+   snprintf(path, sizeof(path), NUMA_SYSFS "/node%d/cpulist", node);
+
+   if (numa_read_cpulist(path, &node_set) > 0)
+      CPU_AND(&node_set, &node_set, &allowed);
+   else
+      node_set = allowed;
+
+   if ((n_cpus = CPU_COUNT(&node_set)) == 0)
+      node_set = allowed, n_cpus = CPU_COUNT(&allowed);
+
+   if (n_cpus == 0)
+      return -1;
+
+   for (cpu = 0, slot %= n_cpus; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &node_set) && slot-- == 0)
+         break;
+   }
+
+   CPU_ZERO(&set);
+   CPU_SET(cpu, &set);
+
+   return (sched_setaffinity(0, sizeof(set), &set) == 0) ? cpu : -1;
+#else
+   return -1;
+#endif
+}
+
+// Save and restore the affinity of the calling thread, for a thread that
+// is pinned only temporarily.
+
+#if defined(__linux__)
+static cpu_set_t numa_saved_set;
+static int numa_saved = 0;
+#endif
+
+static void numa_save(void)
+{
+#if defined(__linux__)
+   numa_saved = (sched_getaffinity(0, sizeof(cpu_set_t), &numa_saved_set) == 0);
+#endif
+}
+
+static void numa_restore(void)
+{
+#if defined(__linux__)
+   if (numa_saved)
+      sched_setaffinity(0, sizeof(cpu_set_t), &numa_saved_set);
+
+   numa_saved = 0;
+#endif
+}
+
+#endif
+
@@ -10,14 +10,45 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
+#if defined(__linux__)
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
+#include "bits.h"
 #include "sprintull.h"
+#include "stats.h"
 
 const int FLUSH_LIMIT = 393000;     // = 384K - 216
 
+// Output formats for printing primes. Text is one decimal number per line.
+// Uint64 is raw 8-byte little-endian values. Delta is a byte stream of
+// checkpoints and gaps:
+//
+//   0x00, followed by 8-byte little-endian prime   (checkpoint)
+//   varint v >= 1, 7 bits per byte, low bits first (prime += 2 * v)
+//
+// A checkpoint starts every batch, follows every CHECKPOINT_INTERVAL
+// primes, and stands in for the odd gap from 2 to 3. Every chunk of
+// output can therefore be decoded on its own.
+
+const int FORMAT_TEXT   = 0;
+const int FORMAT_UINT64 = 1;
+const int FORMAT_DELTA  = 2;
+
+const int CHECKPOINT_INTERVAL = 65536;
+
+static int output_fmt = 0;
+
 int flush_output(int fd, char *endptr, int *lenptr)
 {
    if (*lenptr > 0) {
+      uint64_t t = stats_clock();
       uint32_t written;
 
       if ((written = write(fd, endptr, *lenptr)) != *lenptr) {
@@ -25,16 +56,56 @@ int flush_output(int fd, char *endptr, int *lenptr)
          *lenptr = 0; return -1;
       }
 
+      stats_lap(STAT_WRITE, &t);
       *lenptr = 0;
    }
 
    return 0;
 }
 
+static int put_uint64_le(char *endptr, uint64_t value)
+{
+   int i;
+
+   for (i = 0; i < 8; i++, value >>= 8)
+      endptr[i] = (char) (value & 0xff);
+
+   return 8;
+}
+
+static int put_checkpoint(char *endptr, uint64_t prime)
+{
+   *endptr = 0;
+
+   return 1 + put_uint64_le(endptr + 1, prime);
+}
+
+static int put_varint(char *endptr, uint64_t value)
+{
+   int n_chars = 0;
+
+   while (value >= 0x80) {
+      endptr[n_chars++] = (char) ((value & 0x7f) | 0x80);
+      value >>= 7;
+   }
+
+   endptr[n_chars++] = (char) value;
+
+   return n_chars;
+}
+
 int write_output(int fd, char *endptr, uint64_t prime, int *lenptr)
 {
-   *lenptr += sprintull(endptr + *lenptr, prime);
-   *( endptr + (*lenptr)++ ) = '\n';
+   if (output_fmt == FORMAT_UINT64) {
+      *lenptr += put_uint64_le(endptr + *lenptr, prime);
+   }
+   else if (output_fmt == FORMAT_DELTA) {
+      *lenptr += put_checkpoint(endptr + *lenptr, prime);
+   }
+   else {
+      *lenptr += sprintull(endptr + *lenptr, prime);
+      *( endptr + (*lenptr)++ ) = '\n';
+   }
 
    if (*lenptr > FLUSH_LIMIT)
       return flush_output(fd, endptr, lenptr);
@@ -42,5 +113,224 @@ int write_output(int fd, char *endptr, uint64_t prime, int *lenptr)
    return 0;
 }
 
+// Output a batch of primes in increasing order. For text, after the first
+// one, each prime is obtained by adding the gap to the decimal string of
+// the previous prime, so only the trailing digits that change (plus carry)
+// are rewritten. The string is then copied out as is. The body is also
+// compiled into the ISA variants of the primesieve.c kernels.
+
+KERNEL_INLINE int write_batch_body(
+      int fd, char *endptr, const uint64_t *primes, size_t count, int *lenptr )
+{
+   char dec[48], *beg, *end = dec + sizeof(dec), *p;
+   uint64_t carry, v;
+   size_t i;
+   int n_chars;
+
+   if (count == 0)
+      return 0;
+
+   if (output_fmt == FORMAT_UINT64) {
+      for (i = 0; i < count; i++) {
+         *lenptr += put_uint64_le(endptr + *lenptr, primes[i]);
+
+         if (*lenptr > FLUSH_LIMIT && flush_output(fd, endptr, lenptr))
+            return -1;
+      }
+
+      return 0;
+   }
+
+   if (output_fmt == FORMAT_DELTA) {
+      for (i = 0; i < count; i++) {
+         v = primes[i] - (i ? primes[i - 1] : 0);
+
+         if (i % CHECKPOINT_INTERVAL == 0 || (v & 1))
+            *lenptr += put_checkpoint(endptr + *lenptr, primes[i]);
+         else
+            *lenptr += put_varint(endptr + *lenptr, v >> 1);
+
+         if (*lenptr > FLUSH_LIMIT && flush_output(fd, endptr, lenptr))
+            return -1;
+      }
+
+      return 0;
+   }
+
+   for (i = 0; i < count; i++) {
+      if (i == 0 || (carry = primes[i] - primes[i - 1]) >= 1000000) {
+         n_chars = sprintull(end - 24, primes[i]);
+         beg = end - 24, memmove(end - n_chars, beg, n_chars);
+         beg = end - n_chars;
+      }
+      else {
+         for (p = end - 1; carry; p--) {
+            if (p < beg)
+               *--beg = '0', n_chars++;
+
+            v = (*p - '0') + carry;
+            carry = v / 10, *p = (char) ('0' + v - 10 * carry);
+         }
+      }
+
+      memcpy(endptr + *lenptr, beg, n_chars);
+      *lenptr += n_chars;
+      *( endptr + (*lenptr)++ ) = '\n';
+
+      if (*lenptr > FLUSH_LIMIT && flush_output(fd, endptr, lenptr))
+         return -1;
+   }
+
+   return 0;
+}
+
+int write_output_batch(
+      int fd, char *endptr, const uint64_t *primes, size_t count, int *lenptr )
+{
+   return write_batch_body(fd, endptr, primes, count, lenptr);
+}
+
+// Memory-backed output for print mode. A worker writes its chunk into an
+// anonymous memory file, then sends it to the output stream in chunk order.
+// The kernel moves the pages with sendfile (splice for a pipe), so the data
+// is never read back into user space and no temporary file is created.
+// Returns -1 where memory files are not available.
+
+static int mem_output_open(void)
+{
+#if defined(__linux__) && defined(SYS_memfd_create)
+   return (int) syscall(SYS_memfd_create, "sandbox", 1U);   // MFD_CLOEXEC
+#else
+   return -1;
+#endif
+}
+
+static int64_t mem_output_size(int fd)
+{
+#if defined(__linux__)
+   return (int64_t) lseek(fd, 0, SEEK_CUR);
+#else
+   return -1;
 #endif
+}
+
+#if defined(__linux__)
+
+// Copy bytes [off, size) of the memory file with pread, then write, or
+// pwrite at out_off + off when out_off >= 0. This completes whatever the
+// kernel declined to copy (e.g. copy_file_range across file systems).
+// Finally, rewind the memory file for the next chunk.
+
+static int64_t mem_output_copy(
+      int in_fd, int out_fd, off_t off, off_t size, off_t out_off )
+{
+   char     buf[65536];
+   off_t    pos;
+   ssize_t  n, w;
+
+   while (off < size) {
+      n = (size - off < (off_t) sizeof(buf)) ? size - off : sizeof(buf);
+
+      if ((n = pread(in_fd, buf, n, off)) <= 0)
+         goto error;
+
+      for (pos = 0; pos < n; pos += w) {
+         w = (out_off < 0)
+            ? write(out_fd, buf + pos, n - pos)
+            : pwrite(out_fd, buf + pos, n - pos, out_off + off + pos);
+
+         if (w < 0) {
+            if (errno == EINTR) { w = 0; continue; }
+            goto error;
+         }
+      }
+
+      off += n;
+   }
+
+   if (ftruncate(in_fd, 0) || lseek(in_fd, 0, SEEK_SET))
+      goto error;
+
+   return (int64_t) size;
+
+error:
+   fprintf(stderr, "Could not write to output stream\n");
+   return -1;
+}
+
+#endif
+
+// Send everything written so far to out_fd at its current position.
+// Returns the number of bytes sent, -1 on error.
 
+static int64_t mem_output_send(int in_fd, int out_fd)
+{
+#if defined(__linux__)
+   off_t    size, off;
+   ssize_t  n;
+
+   size = lseek(in_fd, 0, SEEK_CUR), off = 0;
+
+   while (off < size) {
+      if ((n = sendfile(out_fd, in_fd, &off, size - off)) > 0)
+         continue;
+      if (n < 0 && errno == EINTR)
+         continue;
+      break;
+   }
+
+   return mem_output_copy(in_fd, out_fd, off, size, -1);
+#else
+   return -1;
+#endif
+}
+
+// Write everything written so far to the regular file out_fd at offset,
+// reserving the range first. Workers call this concurrently, each with
+// its chunk's offset from the prefix sum of the chunk sizes before it.
+// Returns the number of bytes written, -1 on error.
+
+static int64_t mem_output_pwrite(int in_fd, int out_fd, int64_t offset)
+{
+#if defined(__linux__)
+   off_t    size, off;
+   int64_t  off_in, off_out;
+   ssize_t  n;
+   int      rc;
+
+   size = lseek(in_fd, 0, SEEK_CUR), off = 0;
+
+   if (size > 0 && (rc = posix_fallocate(out_fd, offset, size))) {
+      if (rc != EINVAL && rc != EOPNOTSUPP) {
+         fprintf(stderr, "Could not allocate space in output file\n");
+         return -1;
+      }
+   }
+
+   #if defined(SYS_copy_file_range)
+   while (off < size) {
+      off_in = off, off_out = offset + off;
+      n = syscall(SYS_copy_file_range,
+             in_fd, &off_in, out_fd, &off_out, size - off, 0U);
+
+      if (n > 0) { off += n; continue; }
+      if (n < 0 && errno == EINTR)
+         continue;
+      break;
+   }
+   #endif
+
+   return mem_output_copy(in_fd, out_fd, off, size, offset);
+#else
+   return -1;
+#endif
+}
+
+static void mem_output_close(int fd)
+{
+#if defined(__linux__)
+   if (fd >= 0) close(fd);
+#endif
+}
+
+#endif
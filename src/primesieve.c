@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <math.h>
 
 #include "sandbox.h"
 
@@ -20,12 +21,172 @@
 //
 //#############################################################################
 
+// Number of bits for sums of primes; 64 limits N to 29505444490.
+
+int sum_bits()
+{
+   return SUM_BITS;
+}
+
+// Select the print format: FORMAT_TEXT, FORMAT_UINT64, or FORMAT_DELTA.
+
+void set_output_format(int fmt)
+{
+   output_fmt = fmt;
+}
+
+// Memory-backed output, see output.h.
+
+int output_open()
+{
+   return mem_output_open();
+}
+
+SV* output_size(int fd)
+{
+   return newSViv((IV) mem_output_size(fd));
+}
+
+SV* output_send(int in_fd, int out_fd)
+{
+   return newSViv((IV) mem_output_send(in_fd, out_fd));
+}
+
+SV* output_pwrite(int in_fd, int out_fd, SV *offset_sv)
+{
+   int64_t offset;
+
+   #ifdef __LP64__
+      offset = SvIV(offset_sv);
+   #else
+      offset = strtoll(SvPV_nolen(offset_sv), NULL, 10);
+   #endif
+
+   return newSViv((IV) mem_output_pwrite(in_fd, out_fd, offset));
+}
+
+void output_close(int fd)
+{
+   mem_output_close(fd);
+}
+
+//#############################################################################
+// ----------------------------------------------------------------------------
+// Kernels. As in algorithm3.c, the loops over the primes of a block are
+// compiled once per ISA level through the target attribute, one kernel
+// for summing and one for printing, and the level of the running cpu is
+// chosen on the first call. The print kernel is the batch writer from
+// output.h, whose format branch is outside its loops.
+//
+//#############################################################################
+
+typedef struct {
+   sum_t (*sum)(const uint64_t *, size_t);
+   int   (*print)(int, char *, const uint64_t *, size_t, int *);
+   const char *isa;
+} kernels_t;
+
+static kernels_t kern;
+
+KERNEL_INLINE sum_t sum_body(const uint64_t *primes, size_t size)
+{
+   sum_t  n_ret = 0;
+   size_t i;
+
+   for (i = 0; i < size; i++)
+      n_ret += primes[i];
+
+   return n_ret;
+}
+
+#define KERNELS(attr, lvl) \
+   attr static sum_t sum_##lvl(const uint64_t *primes, size_t size) \
+   { return sum_body(primes, size); } \
+   \
+   attr static int print_##lvl(int fd, char *buf, const uint64_t *primes, \
+         size_t size, int *len) \
+   { return write_batch_body(fd, buf, primes, size, len); }
+
+#define KERNELS_SET(k, lvl) \
+   (k).sum = sum_##lvl, (k).print = print_##lvl, (k).isa = #lvl
+
+KERNELS(, base)
+
+#if defined(POPCOUNT_X86)
+KERNELS(__attribute__((target("avx2,bmi,bmi2,popcnt"))), x86_64_v3)
+#endif
+
+static void kernels_init(void)
+{
+   if (kern.isa != NULL)
+      return;
+
+#if defined(POPCOUNT_X86)
+   __builtin_cpu_init();
+
+   if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi") &&
+         __builtin_cpu_supports("bmi2") &&
+         __builtin_cpu_supports("popcnt")) {
+      KERNELS_SET(kern, x86_64_v3);
+      return;
+   }
+#endif
+
+   KERNELS_SET(kern, base);
+}
+
+// The ISA level of the kernels in use, for reporting.
+
+char* primesieve_isa()
+{
+   kernels_init();
+
+   return (char *) kern.isa;
+}
+
+// Sum and print modes walk the primes of a block with an iterator, one
+// per thread, kept between calls. Moving it to the next block reuses its
+// buffers, so memory does not grow with the block size. The primes are
+// passed to the kernels in batches of PRIMES_BATCH.
+
+#define PRIMES_BATCH 2048
+
+static THREAD_LOCAL primesieve_iterator iter;
+static THREAD_LOCAL int iter_ready;
+
+// Position the iterator so the next prime is the first one >= start.
+
+static void iter_jump(uint64_t start, uint64_t limit)
+{
+   if (!iter_ready)
+      primesieve_init(&iter), iter_ready = 1;
+
+#if PRIMESIEVE_VERSION_MAJOR >= 11
+   primesieve_jump_to(&iter, start, limit);
+#else
+   primesieve_skipto(&iter, start ? start - 1 : 0, limit);
+#endif
+}
+
+// Release the calling thread's iterator and print buffer, kept between
+// calls.
+
+void primesieve_release()
+{
+   if (iter_ready)
+      primesieve_free_iterator(&iter), iter_ready = 0;
+
+   arena_release();
+}
+
 SV* primesieve(SV *start_sv, SV *limit_sv, int run_mode, int fd)
 {
    AV       *ret;
-   uint64_t n_ret, start, limit, *primes;
-   size_t   size, i;
-   int      err;
+   uint64_t start, limit, p, *primes;
+   sum_t    n_ret;
+   size_t   size;
+   int      err, len;
+   char     *buf;
 
    #ifdef __LP64__
       start = SvUV(start_sv);
@@ -35,7 +196,9 @@ SV* primesieve(SV *start_sv, SV *limit_sv, int run_mode, int fd)
       limit = strtoull(SvPV_nolen(limit_sv), NULL, 10);
    #endif
 
-   ret = newAV(), n_ret = 0, err = 0;
+   ret = newAV(), n_ret = 0, err = 0, buf = NULL;
+
+   kernels_init();
 
    //====================================================================
    // Count primes, sum primes, otherwise output primes for this block.
@@ -45,31 +208,29 @@ SV* primesieve(SV *start_sv, SV *limit_sv, int run_mode, int fd)
       n_ret = primesieve_count_primes(start, limit);
    }
    else {
-      primes = primesieve_generate_primes(start, limit, &size, UINT64_PRIMES);
+      primes = (uint64_t *) arena_get(ARENA_BATCH,
+         sizeof(uint64_t) * PRIMES_BATCH);
 
-      if (run_mode == MODE_SUM) {
-         for (i = 0; i < size; i++)
-            n_ret += primes[i];
-      }
-      else {
-         char *buf; int len;
+      if (run_mode == MODE_PRINT)
+         buf = (char *) arena_get(ARENA_PRINT, FLUSH_LIMIT + 216);
 
-         buf = (char *) malloc(sizeof(char) * (FLUSH_LIMIT + 216));
-         len = 0;
+      iter_jump(start, limit);
+      p = primesieve_next_prime(&iter), len = 0;
 
-         for (i = 0; i < size; i++) {
-            if ((err = write_output(fd, buf, primes[i], &len)))
-               break;
+      while (p <= limit && !err) {
+         for (size = 0; p <= limit && size < PRIMES_BATCH; size++) {
+            primes[size] = p;
+            p = primesieve_next_prime(&iter);
          }
 
-         if (!err)
-            err = flush_output(fd, buf, &len);
-
-         free((void *) buf);
-         buf = NULL;
+         if (run_mode == MODE_SUM)
+            n_ret += kern.sum(primes, size);
+         else
+            err = kern.print(fd, buf, primes, size, &len);
       }
 
-      primesieve_free(primes);
+      if (run_mode == MODE_PRINT && !err)
+         err = flush_output(fd, buf, &len);
    }
 
    //====================================================================
@@ -79,6 +240,12 @@ SV* primesieve(SV *start_sv, SV *limit_sv, int run_mode, int fd)
    if (run_mode == MODE_PRINT) {
       av_push(ret, newSViv(err));
    }
+#if SUM_BITS > 64
+   else if (n_ret > UINT64_MAX) {
+      char buf[N_MAXDIGITS128 + 1];
+      av_push(ret, newSVpvn(buf, sprintu128(buf, n_ret)));
+   }
+#endif
    else {
       #ifdef __LP64__
          av_push(ret, newSVuv(n_ret));
@@ -97,3 +264,81 @@ SV* primesieve(SV *start_sv, SV *limit_sv, int run_mode, int fd)
    return newRV_noinc((SV *) ret);
 }
 
+// Fill buf with up to max_count primes in [from, to] as native uint64
+// values, for unpack 'Q*' or the data of a PDL ulonglong ndarray. Returns
+// the number of primes, the cursor (the from for the next call), and 1 once
+// the range is done. The flag, not the cursor, ends the range, as the stop
+// may be 2^64 - 1. The range is clipped to the largest stop libprimesieve
+// accepts.
+
+SV* primesieve_fill(SV *buf_sv, SV *from_sv, SV *to_sv, int max_count)
+{
+   AV       *ret;
+   uint64_t from, to, hi, max_stop, *dst, *primes;
+   size_t   size, n, m;
+   double   span;
+   int      done;
+
+   #ifdef __LP64__
+      from = SvUV(from_sv);
+      to   = SvUV(to_sv);
+   #else
+      from = strtoull(SvPV_nolen(from_sv), NULL, 10);
+      to   = strtoull(SvPV_nolen(to_sv), NULL, 10);
+   #endif
+
+   max_stop = primesieve_get_max_stop();
+
+   if (to > max_stop) to = max_stop;
+   if (max_count < 0) max_count = 0;
+
+   SvUPGRADE(buf_sv, SVt_PV);
+   dst = (uint64_t *) SvGROW(buf_sv, sizeof(uint64_t) * max_count + 1);
+   n = 0, done = (from > to);
+
+   // Generate about as far as the remaining primes need (x / ln x), going
+   // again if short. Stop at hi == to, since hi + 1 may wrap to 0.
+   while (n < (size_t) max_count && !done) {
+      span = (max_count - n) * 1.1 * log((double) from + 16) + 1024;
+      hi = (span >= (double) (to - from)) ? to : from + (uint64_t) span;
+
+      primes = primesieve_generate_primes(from, hi, &size, UINT64_PRIMES);
+
+      if (primes == NULL)
+         break;
+
+      m = (size < max_count - n) ? size : max_count - n;
+      memcpy(dst + n, primes, sizeof(uint64_t) * m), n += m;
+
+      if (m < size)
+         from = primes[m];
+      else if (hi == to)
+         done = 1;
+      else
+         from = hi + 1;
+
+      primesieve_free(primes);
+   }
+
+   SvCUR_set(buf_sv, sizeof(uint64_t) * n);
+   SvPOK_only(buf_sv);
+
+   ret = newAV();
+
+   #ifdef __LP64__
+      av_push(ret, newSVuv(n));
+      av_push(ret, newSVuv(from));
+
+   #else
+   {
+      char buf[N_MAXDIGITS + 1];
+      av_push(ret, newSVpvn(buf, sprintull(buf, n)));
+      av_push(ret, newSVpvn(buf, sprintull(buf, from)));
+   }
+   #endif
+
+   av_push(ret, newSViv(done));
+
+   return newRV_noinc((SV *) ret);
+}
+
@@ -8,7 +8,9 @@
 #ifndef SANDBOX_H
 #define SANDBOX_H
 
+#include "arena.h"
 #include "bits.h"
+#include "stats.h"
 #include "output.h"
 #include "sprintull.h"
 
@@ -16,6 +18,17 @@
 #define strtoull _strtoui64
 #endif
 
+// Sums of primes accumulate in 128 bits if the compiler supports it,
+// lifting the limit of N = 29505444490 for a 64-bit sum.
+
+#if defined(__SIZEOF_INT128__)
+typedef unsigned __int128 sum_t;
+#define SUM_BITS 128
+#else
+typedef uint64_t sum_t;
+#define SUM_BITS 64
+#endif
+
 const int MODE_COUNT = 1;
 const int MODE_PRINT = 2;
 const int MODE_SUM   = 3;
@@ -9,30 +9,67 @@
 #define SPRINTULL_H
 
 #include <stdint.h>
+#include <string.h>
 
 const int N_MAXDIGITS = (sizeof(uint64_t) * 8 * sizeof(char) / 3) + 2;
 
+static const char digits_lut[201] =
+   "00010203040506070809101112131415161718192021222324252627282930313233"
+   "34353637383940414243444546474849505152535455565758596061626364656667"
+   "6869707172737475767778798081828384858687888990919293949596979899";
+
 // This works similarly like sprintf, particularly returning the number of
-// characters.
+// characters. Two digits are converted per step using a lookup table,
+// writing right to left into a scratch buffer; no reversal is needed.
 
 int sprintull(char *endptr, uint64_t value)
 {
-   int n_chars; uint64_t t; char *s = endptr, c;
+   char buf[24], *s = buf + sizeof(buf); int n_chars; uint64_t t;
 
    // base10 to string conversion
-   do {
-      t = value / 10; *s++ = (char) ('0' + value - 10 * t);
-   } while ((value = t));
+   while (value >= 100) {
+      t = value / 100, s -= 2;
+      memcpy(s, digits_lut + 2 * (value - 100 * t), 2);
+      value = t;
+   }
+
+   if (value >= 10)
+      s -= 2, memcpy(s, digits_lut + 2 * value, 2);
+   else
+      *--s = (char) ('0' + value);
 
    // save # of characters not including the trailing '\0'
-   n_chars = s - endptr;  *s = '\0';
+   n_chars = (int) (buf + sizeof(buf) - s);
 
-   // reverse the string in place
-   while (--s > endptr)
-      c = *s, *s = *endptr, *endptr++ = c;
+   memcpy(endptr, s, n_chars);
+   endptr[n_chars] = '\0';
 
    return n_chars;
 }
 
+// Likewise for 128-bit values, converting 19 digits at a time.
+
+#if defined(__SIZEOF_INT128__)
+const int N_MAXDIGITS128 = (sizeof(unsigned __int128) * 8 * sizeof(char) / 3) + 2;
+
+int sprintu128(char *endptr, unsigned __int128 value)
+{
+   const uint64_t p19 = 10000000000000000000ULL;
+   char buf[24]; int n_chars, n;
+
+   if (value <= UINT64_MAX)
+      return sprintull(endptr, (uint64_t) value);
+
+   // leading digits, then the lower 19 digits padded with zeros
+   n_chars = sprintu128(endptr, value / p19);
+   n = sprintull(buf, (uint64_t) (value % p19));
+
+   memset(endptr + n_chars, '0', 19 - n);
+   memcpy(endptr + n_chars + 19 - n, buf, n + 1);
+
+   return n_chars + 19;
+}
+#endif
+
 #endif
 
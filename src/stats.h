@@ -0,0 +1,70 @@
+#line 2 "../src/stats.h"
+//#############################################################################
+// ----------------------------------------------------------------------------
+// C helper functions for per-phase timing (--stats).
+//
+//#############################################################################
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "arena.h"
+
+// Nanoseconds spent per phase, per thread. The clock is read at block
+// granularity (and per write), only if enabled by set_stats.
+//
+//   STAT_SIEVE    pre-sieve copy, small and large sieving primes
+//   STAT_COUNT    popcount, or extracting primes for the sum
+//   STAT_FORMAT   extracting and formatting primes for printing
+//   STAT_WRITE    writes to the output fd, in flush_output
+
+enum {
+   STAT_SIEVE = 0, STAT_COUNT, STAT_FORMAT, STAT_WRITE, STAT_PHASES
+};
+
+static int stats_on = 0;
+
+static THREAD_LOCAL uint64_t stats_ns[STAT_PHASES];
+static THREAD_LOCAL uint64_t stats_blocks, stats_chunks;
+
+static uint64_t stats_clock(void)
+{
+   struct timespec ts;
+
+   if (!stats_on)
+      return 0;
+
+#if defined(CLOCK_MONOTONIC)
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+   timespec_get(&ts, TIME_UTC);
+#endif
+
+   return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Add the time since *t to phase, and restart *t from now.
+
+static void stats_lap(int phase, uint64_t *t)
+{
+   uint64_t now;
+
+   if (!stats_on)
+      return;
+
+   now = stats_clock();
+   stats_ns[phase] += now - *t, *t = now;
+}
+
+static void stats_reset(void)
+{
+   memset(stats_ns, 0, sizeof(stats_ns));
+   stats_blocks = stats_chunks = 0;
+}
+
+#endif
+